@@ -0,0 +1,34 @@
+#include "crc.h"
+
+/* byte at a time without a table, shifts by 4 and 8 are cheap on PIC18 */
+uint16_t crc16_update(uint16_t crc, const uint8_t *buf, size_t count) {
+    uint8_t x;
+
+    while (count--) {
+        x = (uint8_t)(crc >> 8) ^ *buf++;
+        x ^= x >> 4;
+        crc = (crc << 8) ^ ((uint16_t)x << 12) ^ ((uint16_t)x << 5) ^ x;
+    }
+
+    return crc;
+}
+
+/* reflected polynomial 0xEDB88320, 4 bits at a time */
+static const uint32_t crc32_nibble[16] = {
+    0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC,
+    0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+    0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C,
+    0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+};
+
+uint32_t crc32_update(uint32_t crc, const uint8_t *buf, size_t count) {
+    crc = ~crc;
+
+    while (count--) {
+        crc ^= *buf++;
+        crc = (crc >> 4) ^ crc32_nibble[crc & 0x0f];
+        crc = (crc >> 4) ^ crc32_nibble[crc & 0x0f];
+    }
+
+    return ~crc;
+}
@@ -0,0 +1,21 @@
+/*
+ * File:   crc.h
+ *
+ * CRC16-CCITT(polynomial 0x1021, initial value 0xFFFF, no reflection), as
+ * computed by python's binascii.crc_hqx(data, 0xffff) on the host side, and
+ * the zlib CRC32, as computed by python's zlib.crc32(data, crc).
+ */
+
+#ifndef CRC_H
+#define	CRC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CRC16_INIT 0xFFFF
+
+uint16_t crc16_update(uint16_t crc, const uint8_t *buf, size_t count);
+/* start with crc 0, the result can be passed in again to continue */
+uint32_t crc32_update(uint32_t crc, const uint8_t *buf, size_t count);
+
+#endif	/* CRC_H */
@@ -1,113 +1,170 @@
+#include <stdbool.h>
+#include <string.h>
+
 #include <xc.h>
 
-#define FLASH_BLOCK_SIZ 64
+#include "flash.h"
+#include "flash_hw.h"
+
+/*
+ * Row being written, programmed once when writing moves on to another row
+ * or on flash_flush(), so several writes to a row cost one CPU stall.
+ * Bytes not written stay 0xFF, which programs nothing.
+ */
+static uint8_t row_buf[FLASH_BLOCK_SIZ];
+static uint24_t row_buf_addr;
+static bool row_buf_used;
+/*
+ * Rows that read back different after programming, until flash_bad_row()
+ * reports them. One message can program several rows, e.g. the previous
+ * row when writing moves on and the current one when it's read back for
+ * hashing, so each of them is kept for the host to send again.
+ */
+static uint8_t bad_rows[(FLASH_ROWS + 7) / 8];
+static uint16_t bad_rows_cnt;
+
+static bool row_is_bad(uint16_t row) {
+    return bad_rows[row / 8] & (1 << (row % 8));
+}
 
-struct table_pointers {
-    uint8_t up;
-    uint8_t hi;
-    uint8_t lo;
-};
+static void row_set_bad(uint16_t row, bool bad) {
+    if (row_is_bad(row) == bad) {
+        return;
+    }
+    bad_rows[row / 8] ^= (uint8_t)(1 << (row % 8));
+    bad ? bad_rows_cnt++ : bad_rows_cnt--;
+}
 
-static void save_table_pointers(struct table_pointers *tp)
-{
-    tp->up = TBLPTRU;
-    tp->hi = TBLPTRH;
-    tp->lo = TBLPTRL;
+int flash_flush(void) {
+    if (row_buf_used) {
+        row_buf_used = false;
+        flash_hw_program_row(row_buf_addr, row_buf);
+#if FLASH_VERIFY
+        /* every bit the row buffer clears has to read back 0, the others were 0 before or are left alone */
+        if (!flash_hw_row_cleared(row_buf_addr, row_buf)) {
+            row_set_bad((uint16_t)(row_buf_addr / FLASH_BLOCK_SIZ), true);
+        }
+#endif
+    }
+
+    return bad_rows_cnt ? -1 : 0;
 }
 
-static void restore_table_pointers(struct table_pointers *tp)
-{
-    TBLPTRU = tp->up;
-    TBLPTRH = tp->hi;
-    TBLPTRL = tp->lo;
+/* the lowest row to erase and write again, -1 for none, each reported once */
+int flash_bad_row(void) {
+    uint16_t row;
+
+    if (!bad_rows_cnt) {
+        return -1;
+    }
+    for (row = 0; !row_is_bad(row); row++);
+    row_set_bad(row, false);
+    return (int)row;
+}
+
+#ifdef BTLD_SIM
+bool flash_lose_pending(uint24_t *addr) {
+    bool lost = row_buf_used;
+
+    *addr = row_buf_addr;
+    row_buf_used = false;
+    return lost;
+}
+#endif
+
+/* the pending row has to be in flash before it's read */
+static void flash_flush_range(uint24_t addr, size_t count) {
+    if (row_buf_used && addr < row_buf_addr + FLASH_BLOCK_SIZ && addr + count > row_buf_addr) {
+        flash_flush();
+    }
 }
 
 int write_flash(uint24_t addr, const uint8_t *buf, size_t count) {
-    size_t i = 0;
-    struct table_pointers tp;
-    save_table_pointers(&tp);
-
-    TBLPTRU = (uint8_t)(addr >> 16);
-    TBLPTRH = (uint8_t)(addr >> 8);
-    TBLPTRL = (uint8_t)addr & 0xff;
-
-    for (i = 0; i < count; i++) {
-        TABLAT = buf[i];
-
-        if (((addr + 1) % FLASH_BLOCK_SIZ == 0) || (i == count - 1)) {
-            /* don't advance table pointer, to keep it in block range */
-            asm("TBLWT*");
-            /* start the hw flashing procedure */
-            EECON1bits.EEPGD = 1; /* point to Flash memory */
-            EECON1bits.CFGS = 0; /* access Flash program memory */
-            EECON1bits.WREN = 1; /* enable write to memory */
-
-            EECON2 = 0x55;
-            EECON2 = 0xaa;
-
-            /* start programming (CPU stall until done) */
-            EECON1bits.WR = 1;
-            asm("TBLRD*+"); /* increment the pointer but don't write anything, quirk */
-        } else {
-            asm("TBLWT*+");
+    for (size_t i = 0; i < count; i++, addr++) {
+        if (!row_buf_used || addr - row_buf_addr >= FLASH_BLOCK_SIZ) {
+            flash_flush();
+            memset(row_buf, 0xff, sizeof(row_buf));
+            row_buf_addr = addr - addr % FLASH_BLOCK_SIZ;
+            row_buf_used = true;
         }
 
-        addr++;
+        /* programming only clears bits, twice the same byte ANDs them */
+        row_buf[addr % FLASH_BLOCK_SIZ] &= buf[i];
     }
 
-    restore_table_pointers(&tp);
-    return 0;
+    return bad_rows_cnt ? -1 : 0;
 }
 
 void read_flash(uint24_t address, uint8_t *buf, size_t count) {
-    struct table_pointers tp;
-    save_table_pointers(&tp);
+    flash_flush_range(address, count);
+    flash_hw_read(address, buf, count);
+}
+
+/* reads count big endian 32 bit words, without an intermediate byte buffer */
+void read_flash_be32(uint24_t address, uint32_t *words, size_t count) {
+    flash_flush_range(address, count * 4);
+    flash_hw_read_be32(address, words, count);
+}
 
-    TBLPTRU = (uint8_t)(address >> 16);
-    TBLPTRH = (uint8_t)(address >> 8);
-    TBLPTRL = (uint8_t)address & 0xff;
+/* reads the block through TBLRD, an erase cycle on a blank one only wears it */
+bool flash_blk_blank(size_t blk_idx) {
+    uint24_t blk_addr = (uint24_t)blk_idx * FLASH_BLOCK_SIZ;
 
-    for (size_t i = 0; i < count; i++) {
-        asm("TBLRD*+");
-        buf[i] = TABLAT;
+    if (row_buf_used && row_buf_addr == blk_addr) {
+        /* about to be written */
+        return false;
     }
 
-    restore_table_pointers(&tp);
+    return flash_hw_row_blank(blk_addr);
 }
 
-static inline void flash_erase_blk(size_t blk_idx)
+void flash_erase_blk(size_t blk_idx)
 {
     uint24_t blk_addr = (uint24_t)blk_idx * FLASH_BLOCK_SIZ;
-    struct table_pointers tp;
-    save_table_pointers(&tp);
-
-    TBLPTRU = (uint8_t)(blk_addr >> 16);
-    TBLPTRH = (uint8_t)(blk_addr >> 8);
-    TBLPTRL = (uint8_t)(blk_addr & 0xff);
-    EECON1bits.EEPGD = 1; /* point to Flash memory */
-    EECON1bits.CFGS = 0; /* access Flash program memory */
-    EECON1bits.WREN = 1; /* enable write to memory */
-    EECON1bits.FREE = 1; /* enable block erase */
-    EECON2 = 0x55;
-    EECON2 = 0xaa;
-    EECON1bits.WR = 1; /* start programming (CPU stall until done) */
-
-    restore_table_pointers(&tp);
+
+    if (row_buf_used && row_buf_addr == blk_addr) {
+        /* erased anyway */
+        row_buf_used = false;
+    }
+
+    flash_hw_erase_row(blk_addr);
+}
+
+/*
+ * Programs the GOTO to the bootloader at the start of an erased block. It's
+ * all that starts the bootloader, so until it reads back right it's erased
+ * and programmed again from the RAM copy, not left for the host to resend.
+ */
+static void goto_program(size_t blk_idx, const uint8_t *goto_btld) {
+    flash_flush();
+    for (uint8_t tries = FLASH_GOTO_TRIES; tries; tries--) {
+        write_flash((uint24_t)blk_idx * FLASH_BLOCK_SIZ, goto_btld, 4);
+        flash_flush();
+        if (!row_is_bad((uint16_t)blk_idx)) {
+            break;
+        }
+        if (tries > 1) {
+            /* still reported if the last try fails */
+            row_set_bad((uint16_t)blk_idx, false);
+            flash_erase_blk(blk_idx);
+        }
+    }
 }
 
-void erase_flash(uint24_t btld_addr) {
-    size_t erase_blk_cnt = (size_t)(btld_addr / FLASH_BLOCK_SIZ);
+/*
+ * Erases block 0 and puts back the GOTO to the bootloader at the reset
+ * vector. Meanwhile a copy of the GOTO sits in block 1, where execution
+ * lands through the erased block 0 if power fails, so block 1 ends up
+ * erased as well. Each GOTO is programmed before the next erase.
+ */
+void flash_erase_reset_blk(void) {
     uint8_t save_goto_btld[4];
 
     read_flash(0, save_goto_btld, 4);
     flash_erase_blk(1);
-    write_flash(FLASH_BLOCK_SIZ, save_goto_btld, 4);
+    goto_program(1, save_goto_btld);
 
-    for (size_t curr_erase_blk = 0; curr_erase_blk < erase_blk_cnt; curr_erase_blk++) {
-        flash_erase_blk(curr_erase_blk);
-
-        if (curr_erase_blk == 0) {
-            write_flash(0, save_goto_btld, 4);
-        }
-    }
+    flash_erase_blk(0);
+    goto_program(0, save_goto_btld);
+    flash_erase_blk(1);
 }
@@ -1,4 +1,27 @@
+#include <stdbool.h>
+
+#define FLASH_BLOCK_SIZ 64
+/* PIC18F25K22 program memory */
+#define FLASH_SIZE 0x8000UL
+#define FLASH_ROWS (FLASH_SIZE / FLASH_BLOCK_SIZ)
+
+/* 1 to read each row back after programming it */
+#ifndef FLASH_VERIFY
+#define FLASH_VERIFY 1
+#endif
+/* programming attempts for the GOTO to the bootloader */
+#define FLASH_GOTO_TRIES 3
+
+/* both return -1 while rows that didn't program are waiting for flash_bad_row() */
 int write_flash(uint24_t addr, const uint8_t *buf, size_t count);
+int flash_flush(void);
+int flash_bad_row(void);
 void read_flash(uint24_t address, uint8_t *buf, size_t count);
-void erase_flash(uint24_t btld_addr);
-
+void read_flash_be32(uint24_t address, uint32_t *words, size_t count);
+bool flash_blk_blank(size_t blk_idx);
+void flash_erase_blk(size_t blk_idx);
+void flash_erase_reset_blk(void);
+#ifdef BTLD_SIM
+/* a reset loses the row being written with the rest of RAM, true if there was one */
+bool flash_lose_pending(uint24_t *addr);
+#endif
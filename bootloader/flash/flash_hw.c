@@ -0,0 +1,164 @@
+#include <stdbool.h>
+
+#include <xc.h>
+
+#include "flash.h"
+#include "flash_hw.h"
+
+struct table_pointers {
+    uint8_t up;
+    uint8_t hi;
+    uint8_t lo;
+};
+
+static void save_table_pointers(struct table_pointers *tp)
+{
+    tp->up = TBLPTRU;
+    tp->hi = TBLPTRH;
+    tp->lo = TBLPTRL;
+}
+
+static void restore_table_pointers(struct table_pointers *tp)
+{
+    TBLPTRU = tp->up;
+    TBLPTRH = tp->hi;
+    TBLPTRL = tp->lo;
+}
+
+void flash_hw_program_row(uint24_t addr, const uint8_t *buf) {
+    struct table_pointers tp;
+    save_table_pointers(&tp);
+
+    TBLPTRU = (uint8_t)(addr >> 16);
+    TBLPTRH = (uint8_t)(addr >> 8);
+    TBLPTRL = (uint8_t)addr & 0xff;
+
+    for (size_t i = 0; i < FLASH_BLOCK_SIZ; i++) {
+        TABLAT = buf[i];
+
+        if (i == FLASH_BLOCK_SIZ - 1) {
+            /* don't advance table pointer, to keep it in block range */
+            asm("TBLWT*");
+            /* start the hw flashing procedure */
+            EECON1bits.EEPGD = 1; /* point to Flash memory */
+            EECON1bits.CFGS = 0; /* access Flash program memory */
+            EECON1bits.WREN = 1; /* enable write to memory */
+
+            EECON2 = 0x55;
+            EECON2 = 0xaa;
+
+            /* start programming (CPU stall until done) */
+            EECON1bits.WR = 1;
+            asm("TBLRD*+"); /* increment the pointer but don't write anything, quirk */
+        } else {
+            asm("TBLWT*+");
+        }
+    }
+
+    restore_table_pointers(&tp);
+}
+
+void flash_hw_erase_row(uint24_t addr)
+{
+    struct table_pointers tp;
+
+    save_table_pointers(&tp);
+
+    TBLPTRU = (uint8_t)(addr >> 16);
+    TBLPTRH = (uint8_t)(addr >> 8);
+    TBLPTRL = (uint8_t)(addr & 0xff);
+    EECON1bits.EEPGD = 1; /* point to Flash memory */
+    EECON1bits.CFGS = 0; /* access Flash program memory */
+    EECON1bits.WREN = 1; /* enable write to memory */
+    EECON1bits.FREE = 1; /* enable block erase */
+    EECON2 = 0x55;
+    EECON2 = 0xaa;
+    EECON1bits.WR = 1; /* start programming (CPU stall until done) */
+
+    restore_table_pointers(&tp);
+}
+
+void flash_hw_read(uint24_t addr, uint8_t *buf, size_t count) {
+    struct table_pointers tp;
+
+    save_table_pointers(&tp);
+
+    TBLPTRU = (uint8_t)(addr >> 16);
+    TBLPTRH = (uint8_t)(addr >> 8);
+    TBLPTRL = (uint8_t)addr & 0xff;
+
+    for (size_t i = 0; i < count; i++) {
+        asm("TBLRD*+");
+        buf[i] = TABLAT;
+    }
+
+    restore_table_pointers(&tp);
+}
+
+void flash_hw_read_be32(uint24_t addr, uint32_t *words, size_t count) {
+    struct table_pointers tp;
+    uint32_t w;
+
+    save_table_pointers(&tp);
+
+    TBLPTRU = (uint8_t)(addr >> 16);
+    TBLPTRH = (uint8_t)(addr >> 8);
+    TBLPTRL = (uint8_t)addr & 0xff;
+
+    for (size_t i = 0; i < count; i++) {
+        asm("TBLRD*+");
+        w = TABLAT;
+        asm("TBLRD*+");
+        w = (w << 8) | TABLAT;
+        asm("TBLRD*+");
+        w = (w << 8) | TABLAT;
+        asm("TBLRD*+");
+        words[i] = (w << 8) | TABLAT;
+    }
+
+    restore_table_pointers(&tp);
+}
+
+bool flash_hw_row_blank(uint24_t addr) {
+    struct table_pointers tp;
+    bool blank = true;
+
+    save_table_pointers(&tp);
+
+    TBLPTRU = (uint8_t)(addr >> 16);
+    TBLPTRH = (uint8_t)(addr >> 8);
+    TBLPTRL = (uint8_t)(addr & 0xff);
+
+    for (size_t i = 0; i < FLASH_BLOCK_SIZ; i++) {
+        asm("TBLRD*+");
+        if (TABLAT != 0xff) {
+            blank = false;
+            break;
+        }
+    }
+
+    restore_table_pointers(&tp);
+    return blank;
+}
+
+bool flash_hw_row_cleared(uint24_t addr, const uint8_t *buf) {
+    struct table_pointers tp;
+    bool cleared = true;
+
+    save_table_pointers(&tp);
+
+    TBLPTRU = (uint8_t)(addr >> 16);
+    TBLPTRH = (uint8_t)(addr >> 8);
+    TBLPTRL = (uint8_t)addr & 0xff;
+
+    for (size_t i = 0; i < FLASH_BLOCK_SIZ; i++) {
+        asm("TBLRD*+");
+        if (TABLAT & (uint8_t)~buf[i]) {
+            cleared = false;
+            break;
+        }
+    }
+
+    restore_table_pointers(&tp);
+    return cleared;
+}
@@ -0,0 +1,23 @@
+/*
+ * File:   flash_hw.h
+ *
+ * Program memory primitives under flash.c: one row programming or erase
+ * cycle, and the TBLRD reads. flash_hw.c drives the PIC18 registers, the
+ * simulator has its own in sim/flash.c. Addresses are in range and the
+ * rows are aligned, flash.c takes care of it.
+ */
+
+#include <stdbool.h>
+
+#include <xc.h>
+
+/* programs the row at addr with buf, CPU stalled until done */
+void flash_hw_program_row(uint24_t addr, const uint8_t *buf);
+void flash_hw_erase_row(uint24_t addr);
+void flash_hw_read(uint24_t addr, uint8_t *buf, size_t count);
+/* count big endian 32 bit words, without an intermediate byte buffer */
+void flash_hw_read_be32(uint24_t addr, uint32_t *words, size_t count);
+/* every byte of the row reads 0xFF */
+bool flash_hw_row_blank(uint24_t addr);
+/* every bit buf clears reads back 0 */
+bool flash_hw_row_cleared(uint24_t addr, const uint8_t *buf);
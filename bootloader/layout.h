@@ -0,0 +1,50 @@
+/*
+ * File:   layout.h
+ * Author: spanceac
+ *
+ * Flash layout of the bootloader metadata, right below BTLD_OFFSET.
+ */
+
+#ifndef LAYOUT_H
+#define	LAYOUT_H
+
+/* skip the full signature check on boots after a successful one */
+#ifndef BOOT_TOKEN
+#define BOOT_TOKEN 0
+#endif
+
+#define SIGNAT_SIZE 64
+#define CODE_SIZE_BYTES 3
+#define CODE_SIZE_OFFSET BTLD_OFFSET - CODE_SIZE_BYTES
+#define SIGNAT_OFFSET CODE_SIZE_OFFSET - SIGNAT_SIZE
+
+#if BOOT_TOKEN
+/* verified boot token, alone in the flash block below the signature */
+#define BOOT_TOKEN_OFFSET ((SIGNAT_OFFSET) / FLASH_BLOCK_SIZ * FLASH_BLOCK_SIZ - FLASH_BLOCK_SIZ)
+/* user code must end before this address */
+#define APP_END_OFFSET BOOT_TOKEN_OFFSET
+#else
+#define APP_END_OFFSET (SIGNAT_OFFSET)
+#endif
+
+/*
+ * With STAGING_OFFSET, images are received in a staging slot there, laid
+ * out like the flash below BTLD_OFFSET, and copied over the application
+ * once their signature checks out. The install record takes the row after.
+ */
+#ifdef STAGING_OFFSET
+/* rows are erased whole, and the slot must stay clear of the application
+ * and the bootloader start; the linker keeps the bootloader code out of it */
+#if (STAGING_OFFSET) % FLASH_BLOCK_SIZ || (STAGING_OFFSET) <= BTLD_OFFSET
+#error "STAGING_OFFSET must be row aligned and above BTLD_OFFSET"
+#endif
+#if defined(_ROMSIZE) && (STAGING_OFFSET) + BTLD_OFFSET + FLASH_BLOCK_SIZ > _ROMSIZE
+#error "the staging slot and its install record don't fit in flash"
+#endif
+#define RX_SLOT (STAGING_OFFSET)
+#define INSTALL_OFFSET ((STAGING_OFFSET) + BTLD_OFFSET)
+#else
+#define RX_SLOT 0
+#endif
+
+#endif	/* LAYOUT_H */
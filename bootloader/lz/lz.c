@@ -0,0 +1,58 @@
+#include "lz.h"
+#include "../flash/flash.h"
+
+int lz_unpack(uint24_t base, uint24_t addr, const uint8_t *in, size_t in_len, uint8_t *out, size_t out_max) {
+    size_t out_len = 0;
+    uint8_t flags = 0;
+    uint8_t items = 0;
+    uint16_t token;
+    uint16_t dist;
+    uint8_t len;
+    uint24_t src;
+
+    while (in_len) {
+        if (!items) {
+            flags = *in++;
+            in_len--;
+            items = 8;
+            continue;
+        }
+
+        if (flags & 1) {
+            if (out_len == out_max) {
+                return -1;
+            }
+            out[out_len++] = *in++;
+            in_len--;
+        } else {
+            if (in_len < 2) {
+                return -1;
+            }
+            token = (uint16_t)in[0] << 8 | in[1];
+            in += 2;
+            in_len -= 2;
+
+            dist = (token >> 4) + 1;
+            len = (uint8_t)(token & 0x0f) + LZ_MIN_MATCH;
+            if (dist > addr - base + out_len || len > out_max - out_len) {
+                return -1;
+            }
+
+            /* byte by byte, the copy may overlap its own output */
+            src = addr + out_len - dist;
+            for (; len; len--, src++) {
+                if (src < addr) {
+                    read_flash(src, &out[out_len], 1);
+                } else {
+                    out[out_len] = out[src - addr];
+                }
+                out_len++;
+            }
+        }
+
+        flags >>= 1;
+        items--;
+    }
+
+    return (int)out_len;
+}
@@ -0,0 +1,32 @@
+/*
+ * File:   lz.h
+ *
+ * LZSS decoder for the compressed data messages. There is no RAM window:
+ * back-references below the output address are read from the image already
+ * in flash, the others from the output itself.
+ *
+ * A flag byte announces the next 8 items, least significant bit first. A 1
+ * bit is a literal byte, a 0 bit a back-reference of 2 bytes, big endian:
+ * distance - 1 in the upper 12 bits, length - LZ_MIN_MATCH in the lower 4.
+ */
+
+#ifndef LZ_H
+#define	LZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <xc.h>
+
+#define LZ_MIN_MATCH 3
+#define LZ_MAX_MATCH (LZ_MIN_MATCH + 15)
+#define LZ_WINDOW 4096
+
+/*
+ * Unpacks in_len bytes from in into out, as the data to be written at addr
+ * in the image starting at base. Returns the unpacked size, or -1 if the
+ * data doesn't fit in out_max bytes or points below base.
+ */
+int lz_unpack(uint24_t base, uint24_t addr, const uint8_t *in, size_t in_len, uint8_t *out, size_t out_max);
+
+#endif	/* LZ_H */
@@ -10,15 +10,14 @@
 
 #include "sha256/sha256.h"
 #include "uECC/uECC.h"
+#include "crc/crc.h"
+#include "lz/lz.h"
 #include "uart/uart.h"
 #include "flash/flash.h"
 
 #include "mcu/mcu.h"
 
-#define SIGNAT_SIZE 64
-#define CODE_SIZE_BYTES 3
-#define CODE_SIZE_OFFSET BTLD_OFFSET - CODE_SIZE_BYTES
-#define SIGNAT_OFFSET CODE_SIZE_OFFSET - SIGNAT_SIZE
+#include "layout.h"
 
 #define HOST_MSG_START '@'
 #define HOST_MSG_END '\n'
@@ -28,28 +27,69 @@
 #define HOST_MSG_PROGRAM_SIGNAT 'N'
 #define HOST_MSG_FLASH_DATA 'D'
 #define HOST_MSG_FLASH_STOP 'X'
+#define HOST_MSG_ERASE 'E'
+#define HOST_MSG_ROW_CRC 'C'
+#define HOST_MSG_ROWS_HASH 'H'
+#define HOST_MSG_FLASH_PACKED 'Z'
 
 #define MCU_MSG_OP_SUCCESS 'F'
+#define MCU_MSG_RESEND 'R'
 
 #define MCU_MSG_SIG_CHECK_OK 'S'
 #define MCU_MSG_SIG_CHECK_FAIL 'K'
 
 #define MCU_ERR_INVALID_PAYLOAD 'I'
 #define MCU_ERR_DENIED_ADDR 'A'
+/* followed by the row number, big endian, the session goes on */
+#define MCU_ERR_VERIFY 'V'
 
 #define HOST_HANDSHAKE_MSG "@BTL\n"
 #define MCU_HANDSHAKE_RESP "@OK\n"
+/* session setup request start, then the option, a digit and \n */
+#define HOST_SETUP_MSG "@"
+#define HOST_SETUP_SPEED 'S'
+#define HOST_SETUP_FRAMING 'F'
+#define HOST_SETUP_TIMEOUT_US 60000
+/* for the host to repeat the handshake at the new speed */
+#define HOST_BAUD_CHECK_TIMEOUT_US 60000
+/* setup timeouts to wait for the next request once a speed didn't work */
+#define HOST_SETUP_RETRY_WINDOWS 3
+
+/* ends a COBS framed message */
+#define HOST_MSG_COBS_END 0x00
 
 #define HOST_MSG_DATA_PAYLOAD_OFFSET 4
+#define HOST_MSG_PACKED_PAYLOAD_OFFSET 3
+/* start byte, operation, sequence number and payload length */
+#define HOST_MSG_HEADER_SIZE 4
+/* CRC16 of operation, sequence number, length and payload, big endian */
+#define HOST_MSG_CRC_SIZE 2
+/* a full flash row of data is the biggest payload */
+#define HOST_MSG_MAX_PAYLOAD (HOST_MSG_DATA_PAYLOAD_OFFSET + FLASH_BLOCK_SIZ)
+
+/* flash rows below the bootloader, application and metadata */
+#define APP_ROWS (BTLD_OFFSET / FLASH_BLOCK_SIZ)
+/* SHA256 bytes sent back for a range of rows */
+#define ROWS_HASH_SIZE 16
+
+/* how the host messages are delimited on the wire */
+enum framing {
+    FRAMING_ESCAPED, /* @ ... \n, with \ escapes */
+    FRAMING_COBS, /* COBS, ended by a 0 byte */
+    FRAMING_COUNT,
+};
 
 enum flashing_status {
     STATUS_NO_ERR,
     STATUS_FLASHING_DONE,
     STATUS_ERR_INVALID_PAYLOAD,
     STATUS_ERR_DENIED_ADDR,
+    STATUS_ERR_VERIFY,
 };
 
-char mcu_errs[] = {MCU_MSG_OP_SUCCESS, MCU_ERR_INVALID_PAYLOAD, MCU_ERR_DENIED_ADDR};
+/* indexed by enum flashing_status */
+char mcu_errs[] = {MCU_MSG_OP_SUCCESS, MCU_MSG_OP_SUCCESS, MCU_ERR_INVALID_PAYLOAD, MCU_ERR_DENIED_ADDR,
+                   MCU_ERR_VERIFY};
 //#define DEBUG
 
 const uint8_t ec_pub_key[] = {
@@ -60,15 +100,627 @@ const uint8_t ec_pub_key[] = {
                               0xa0,0xe2,0x9a,0xa8,0xa6,0x9e,0xfc,0x2c
 };
 
+#if BOOT_TOKEN
+#define BOOT_TOKEN_MAGIC 0x5A
+#define BOOT_TOKEN_CHECK_SIZE 8
+
+/*
+ * Verified state record at BOOT_TOKEN_OFFSET. The counter is programmed
+ * when flashing starts, the rest after the image passes signature_valid().
+ */
+struct boot_token {
+    uint8_t counter[2]; /* incremented on every flashing, big endian */
+    uint8_t magic;
+    uint8_t size[CODE_SIZE_BYTES];
+    uint8_t crc[4]; /* boot_token_crc() of the verified image, big endian */
+    uint8_t check[BOOT_TOKEN_CHECK_SIZE];
+};
+#endif
+
+static uint24_t image_size(uint24_t slot) {
+    uint8_t d[CODE_SIZE_BYTES];
+#ifdef DEBUG
+    char print[20];
+#endif
+
+    read_flash(slot + CODE_SIZE_OFFSET, d, sizeof(d));
+
+#ifdef DEBUG
+    snprintf(print, sizeof(print) - 1, "fw_siz: %lu\n\0",
+             ((uint24_t)d[0] << 16) | ((uint24_t)d[1] << 8) | d[2]);
+    uart_send_buf(print, strlen(print));
+#endif
+
+    return ((uint24_t)d[0] << 16) | ((uint24_t)d[1] << 8) | d[2];
+}
+
+/* reads a flash row of the image in slot the way it is in the signed hex file */
+static void image_read_row(uint24_t slot, uint16_t row, uint8_t flread[]) {
+    uint24_t addr = (uint24_t)row * FLASH_BLOCK_SIZ;
+
+    read_flash(slot + addr, flread, FLASH_BLOCK_SIZ);
+
+    /* the metadata isn't part of the hex file */
+    if (addr + FLASH_BLOCK_SIZ > APP_END_OFFSET) {
+        addr = addr < APP_END_OFFSET ? APP_END_OFFSET - addr : 0;
+        memset(flread + addr, 0xff, FLASH_BLOCK_SIZ - addr);
+    }
+
+    if (row != 0) {
+        return;
+    }
+
+    /* checksum goto user code as being at addr 0, and 
+     * addr 4-8 put 0xff as in original hex */
+    flread[0] = flread[4];
+    flread[1] = flread[5];
+    flread[2] = flread[6];
+    flread[3] = flread[7];
+
+    memset(flread + 4, 0xff, 4);
+}
+
+/* hashes the first flash block the way it is in the signed hex file */
+static void image_hash_head(uint24_t slot, SHA256_CTX *ctx) {
+    uint8_t flread[FLASH_BLOCK_SIZ];
+#ifdef DEBUG
+    char print[20];
+    size_t i;
+#endif
+
+    image_read_row(slot, 0, flread);
+
+#ifdef DEBUG
+    for (i = 0; i < 8; i++) {
+        snprintf(print, sizeof(print) - 1, "print[%d]: 0x%02X\n\0", i, flread[i]);
+        uart_send_buf(print, strlen(print));
+    }
+#endif
+
+    sha256_update(ctx, flread, sizeof(flread));
+}
+
+static int signature_verify(uint24_t slot, const BYTE cksum[]) {
+    uint8_t signat[SIGNAT_SIZE];
+    const struct uECC_Curve_t * curve = uECC_secp256k1();
+#ifdef DEBUG
+    char print[SIGNAT_SIZE * 2 + 20];
+    size_t i;
+#endif
+
+    read_flash(slot + SIGNAT_OFFSET, signat, sizeof(signat));
+
+#ifdef DEBUG
+    char *p_buf = print;
+    memcpy(p_buf, "sha256: ", strlen("sha256: "));
+    p_buf += strlen("sha256: ");
+    for (i = 0; i < SHA256_BLOCK_SIZE; i++) {
+        sprintf(p_buf, "%02X", cksum[i]);
+        p_buf += 2;
+    }
+    memcpy(p_buf, "\n\0", 2);
+    uart_send_buf(print, strlen(print));
+
+    p_buf = print;
+    memcpy(p_buf, "signat: ", strlen("signat: "));
+    p_buf += strlen("signat: ");
+    for (i = 0; i < SIGNAT_SIZE; i++) {
+        sprintf(p_buf, "%02X", signat[i]);
+        p_buf += 2;
+    }
+    memcpy(p_buf, "\n\0", 2);
+    uart_send_buf(print, strlen(print));
+    return 0;
+#else
+    return uECC_verify(ec_pub_key, cksum, SHA256_BLOCK_SIZE, signat, curve);
+#endif
+}
+
+static int slot_signature_valid(uint24_t slot, BYTE cksum[]) {
+    SHA256_CTX ctx;
+    uint24_t siz = image_size(slot);
+
+    /* blank or corrupt size, nothing to hash */
+    if (siz < FLASH_BLOCK_SIZ || siz > APP_END_OFFSET) {
+        return 0;
+    }
+
+    sha256_init(&ctx);
+    image_hash_head(slot, &ctx);
+    sha256_update_flash(&ctx, slot + FLASH_BLOCK_SIZ, (size_t)(siz - FLASH_BLOCK_SIZ));
+    sha256_final(&ctx, cksum);
+
+    return signature_verify(slot, cksum);
+}
+
+/* checks the image in the application slot, the one that boots */
+int signature_valid(BYTE cksum[]) {
+    return slot_signature_valid(0, cksum);
+}
+
+/*
+ * Hash of the image kept up to date while it is received, so the signature
+ * can be checked as soon as flashing ends. Each D message extends it up to
+ * the end of its data, reading back the flash exactly like signature_valid()
+ * does; a message below what was already hashed makes it unusable.
+ */
+static struct {
+    SHA256_CTX ctx;
+    uint24_t next_addr;
+    bool in_order;
+} rx_hash;
+
+static void rx_hash_init(void) {
+    sha256_init(&rx_hash.ctx);
+    rx_hash.next_addr = 0;
+    rx_hash.in_order = true;
+}
+
+static void rx_hash_to(uint24_t end) {
+    if (rx_hash.next_addr == 0) {
+        if (end < FLASH_BLOCK_SIZ) {
+            return; /* first block is hashed once complete, with the GOTO fixup */
+        }
+        image_hash_head(RX_SLOT, &rx_hash.ctx);
+        rx_hash.next_addr = FLASH_BLOCK_SIZ;
+    }
+
+    if (end > rx_hash.next_addr) {
+        sha256_update_flash(&rx_hash.ctx, RX_SLOT + rx_hash.next_addr, (size_t)(end - rx_hash.next_addr));
+        rx_hash.next_addr = end;
+    }
+}
+
+static void rx_hash_data(uint24_t addr, uint8_t cnt) {
+    if (addr < rx_hash.next_addr) {
+        rx_hash.in_order = false;
+    }
+    if (rx_hash.in_order) {
+        rx_hash_to(addr + cnt);
+    }
+}
+
+/* checks the image that was just received, falls back to a full hash if needed */
+static int image_verify(BYTE cksum[]) {
+    uint24_t siz = image_size(RX_SLOT);
+
+    if (!rx_hash.in_order || rx_hash.next_addr > siz ||
+        siz < FLASH_BLOCK_SIZ || siz > APP_END_OFFSET) {
+        return slot_signature_valid(RX_SLOT, cksum);
+    }
+
+    rx_hash_to(siz);
+    sha256_final(&rx_hash.ctx, cksum);
+
+    return signature_verify(RX_SLOT, cksum);
+}
+
+#if BOOT_TOKEN
+/*
+ * Computes the value binding the token to the signature block and to the
+ * token contents: a truncated SHA256 over signature, counter, size and CRC.
+ */
+static void boot_token_check(const struct boot_token *token, uint8_t check[]) {
+    SHA256_CTX ctx;
+    BYTE hash[SHA256_BLOCK_SIZE];
+    uint8_t signat[SIGNAT_SIZE];
+
+    read_flash(SIGNAT_OFFSET, signat, sizeof(signat));
+
+    sha256_init(&ctx);
+    sha256_update(&ctx, signat, sizeof(signat));
+    sha256_update(&ctx, (const BYTE *)token, offsetof(struct boot_token, check));
+    sha256_final(&ctx, hash);
+
+    memcpy(check, hash, BOOT_TOKEN_CHECK_SIZE);
+}
+
+/*
+ * CRC32 of the application flash up to siz, as programmed. Much cheaper
+ * than the signature check, it catches an image changed since then.
+ */
+static uint32_t boot_token_crc(uint24_t siz) {
+    uint8_t flread[FLASH_BLOCK_SIZ];
+    uint32_t crc = 0;
+    uint24_t addr;
+    size_t cnt;
+
+    for (addr = 0; addr < siz; addr += cnt) {
+        cnt = siz - addr < sizeof(flread) ? (size_t)(siz - addr) : sizeof(flread);
+        read_flash(addr, flread, cnt);
+        crc = crc32_update(crc, flread, cnt);
+    }
+
+    return crc;
+}
+
+/*
+ * The token is erased together with the application whenever a new image
+ * is flashed, so a complete token means the image was verified already, as
+ * long as the application flash still has the CRC it had then.
+ */
+static bool boot_token_valid(void) {
+    struct boot_token token;
+    uint8_t d[CODE_SIZE_BYTES];
+    uint8_t check[BOOT_TOKEN_CHECK_SIZE];
+    uint24_t siz;
+    uint32_t crc;
+
+    read_flash(BOOT_TOKEN_OFFSET, (uint8_t *)&token, sizeof(token));
+    if (token.magic != BOOT_TOKEN_MAGIC) {
+        return false;
+    }
+
+    read_flash(CODE_SIZE_OFFSET, d, sizeof(d));
+    if (memcmp(d, token.size, sizeof(d))) {
+        return false;
+    }
+
+    boot_token_check(&token, check);
+    if (memcmp(check, token.check, sizeof(check))) {
+        return false;
+    }
+
+    siz = (uint24_t)d[0] << 16 | (uint24_t)d[1] << 8 | d[2];
+    if (siz > APP_END_OFFSET) {
+        return false;
+    }
+    crc = boot_token_crc(siz);
+    return token.crc[0] == (uint8_t)(crc >> 24) && token.crc[1] == (uint8_t)(crc >> 16) &&
+           token.crc[2] == (uint8_t)(crc >> 8) && token.crc[3] == (uint8_t)crc;
+}
+
+static uint16_t boot_token_counter(void) {
+    uint8_t counter[2];
+
+    read_flash(BOOT_TOKEN_OFFSET, counter, sizeof(counter));
+    return (uint16_t)counter[0] << 8 | counter[1];
+}
+
+/* starts a new token for the image about to be flashed, only the counter is set */
+static void boot_token_init(uint16_t counter) {
+    uint8_t d[2];
+
+    d[0] = (uint8_t)(counter >> 8);
+    d[1] = (uint8_t)counter;
+    write_flash(BOOT_TOKEN_OFFSET, d, sizeof(d));
+}
+
+/* completes the token after a successful signature check */
+static void boot_token_write(void) {
+    struct boot_token token;
+    uint24_t siz;
+    uint32_t crc;
+
+    read_flash(BOOT_TOKEN_OFFSET, (uint8_t *)&token, sizeof(token));
+    if (token.magic != 0xff) {
+        /* stale token, the rest of the record can't be programmed over it */
+        flash_erase_blk(BOOT_TOKEN_OFFSET / FLASH_BLOCK_SIZ);
+        boot_token_init((uint16_t)(((uint16_t)token.counter[0] << 8 | token.counter[1]) + 1));
+    }
+
+    read_flash(BOOT_TOKEN_OFFSET, token.counter, sizeof(token.counter));
+    token.magic = BOOT_TOKEN_MAGIC;
+    read_flash(CODE_SIZE_OFFSET, token.size, sizeof(token.size));
+    siz = (uint24_t)token.size[0] << 16 | (uint24_t)token.size[1] << 8 | token.size[2];
+    crc = boot_token_crc(siz);
+    token.crc[0] = (uint8_t)(crc >> 24);
+    token.crc[1] = (uint8_t)(crc >> 16);
+    token.crc[2] = (uint8_t)(crc >> 8);
+    token.crc[3] = (uint8_t)crc;
+    boot_token_check(&token, token.check);
+
+    write_flash(BOOT_TOKEN_OFFSET + sizeof(token.counter), &token.magic,
+                sizeof(token) - sizeof(token.counter));
+    flash_flush();
+}
+#endif
+
+/*
+ * Rows erased since the handshake. The first message changing the flash
+ * erases the metadata rows, then each row is erased right before it's first
+ * written to. The host erases the blank rows of the image with E, and, unless
+ * it's a differential update keeping the unchanged rows, the rest of the
+ * application with an E without payload once all the data is sent.
+ */
+static uint8_t erased_rows[(APP_ROWS + 7) / 8];
+
+static bool row_is_erased(uint16_t row) {
+    return erased_rows[row / 8] & (1 << (row % 8));
+}
+
+static void row_set_erased(uint16_t row) {
+    erased_rows[row / 8] |= (uint8_t)(1 << (row % 8));
+}
+
+/* row 0 didn't program, the host sends row 1 again after it */
+static bool reset_row_bad;
+
+/* a row that didn't program is erased again when the host sends it again */
+static void row_set_unerased(uint16_t row) {
+    if (row == 0) {
+        reset_row_bad = true;
+    }
+    erased_rows[row / 8] &= (uint8_t)~(1 << (row % 8));
+}
+
+static enum flashing_status row_erase(uint16_t row) {
+    if (row_is_erased(row)) {
+        return STATUS_NO_ERR;
+    }
+
+    if (row == 0 && RX_SLOT == 0) {
+        /* row 1 is erased as well, it can't be once written */
+        if (row_is_erased(1) && !reset_row_bad) {
+            return STATUS_ERR_DENIED_ADDR;
+        }
+        flash_erase_reset_blk();
+        reset_row_bad = false;
+        row_set_erased(1);
+    } else if (!flash_blk_blank(RX_SLOT / FLASH_BLOCK_SIZ + row)) {
+        flash_erase_blk(RX_SLOT / FLASH_BLOCK_SIZ + row);
+    }
+    row_set_erased(row);
+
+    if ((uint24_t)row * FLASH_BLOCK_SIZ < rx_hash.next_addr) {
+        /* already hashed as it was */
+        rx_hash.in_order = false;
+    }
+
+    return STATUS_NO_ERR;
+}
+
+static enum flashing_status rows_erase(uint16_t first, uint16_t count) {
+    enum flashing_status status;
+
+    if ((uint24_t)first + count > APP_ROWS) {
+        return STATUS_ERR_DENIED_ADDR;
+    }
+
+    for (; count; count--, first++) {
+        status = row_erase(first);
+        if (status != STATUS_NO_ERR) {
+            return status;
+        }
+    }
+
+    return STATUS_NO_ERR;
+}
+
+static void rows_init(void) {
+    memset(erased_rows, 0, sizeof(erased_rows));
+}
+
+/*
+ * Erases the size, signature and boot token, the old image won't boot
+ * anymore. Until the first message changing the flash, the host can query
+ * it and end the session without harm. With a staging slot, that's the
+ * previous staged image, and its install record, while the application
+ * keeps booting.
+ */
+static void image_invalidate(void) {
+#if BOOT_TOKEN && !defined(STAGING_OFFSET)
+    uint16_t token_counter;
+    bool token_erased = row_is_erased(BOOT_TOKEN_OFFSET / FLASH_BLOCK_SIZ);
+#endif
+
+    /* the last row holds the image size, it's erased the first time */
+    if (row_is_erased(APP_ROWS - 1)) {
+        return;
+    }
+
+#ifdef STAGING_OFFSET
+    if (!flash_blk_blank(INSTALL_OFFSET / FLASH_BLOCK_SIZ)) {
+        flash_erase_blk(INSTALL_OFFSET / FLASH_BLOCK_SIZ);
+    }
+#endif
+#if BOOT_TOKEN && !defined(STAGING_OFFSET)
+    token_counter = boot_token_counter();
+#endif
+    rows_erase(APP_END_OFFSET / FLASH_BLOCK_SIZ, APP_ROWS - APP_END_OFFSET / FLASH_BLOCK_SIZ);
+#if BOOT_TOKEN && !defined(STAGING_OFFSET)
+    /* not when only the last row is erased again, after it didn't program */
+    if (!token_erased) {
+        boot_token_init(token_counter + 1);
+    }
+#endif
+}
+
+#ifdef STAGING_OFFSET
+/*
+ * Install record, in the row after the staging slot: the first byte is
+ * programmed once the staged image passed its signature check, the second
+ * once it's copied over the application. With only the first one, the copy
+ * was cut short and is done again at the next reset.
+ */
+#define INSTALL_MAGIC 0x5A
+#define INSTALL_TRIES 3
+
+static bool install_pending(void) {
+    uint8_t rec[2];
+
+    read_flash(INSTALL_OFFSET, rec, sizeof(rec));
+    return rec[0] == INSTALL_MAGIC && rec[1] != INSTALL_MAGIC;
+}
+
+static void install_mark(uint8_t idx) {
+    uint8_t magic = INSTALL_MAGIC;
+
+    write_flash(INSTALL_OFFSET + idx, &magic, 1);
+    flash_flush();
+}
+
+/*
+ * Copies the staged image over the application slot, skipping the rows
+ * that already match, e.g. after a differential update. Bytes 0-3 of the
+ * staged row 0 are 0xFF, so the GOTO to the bootloader stays. A row that
+ * doesn't program leaves the record pending, for the next reset to retry.
+ */
+static bool image_install(void) {
+    uint8_t staged[FLASH_BLOCK_SIZ];
+    uint8_t flread[FLASH_BLOCK_SIZ];
+    uint24_t addr;
+    uint8_t skip;
+    uint8_t tries;
+#if BOOT_TOKEN
+    /* the staged token row is blank, the copy erases the token */
+    uint16_t token_counter = boot_token_counter();
+#endif
+
+    while (flash_bad_row() >= 0);
+    for (uint16_t row = 0; row < APP_ROWS; row++) {
+        addr = (uint24_t)row * FLASH_BLOCK_SIZ;
+        /* the GOTO to the bootloader isn't staged */
+        skip = row == 0 ? 4 : 0;
+        read_flash(STAGING_OFFSET + addr, staged, sizeof(staged));
+        for (tries = INSTALL_TRIES; tries; tries--) {
+            /* erasing row 0 erases row 1 too, which then no longer matches */
+            read_flash(addr, flread, sizeof(flread));
+            if (!memcmp(flread + skip, staged + skip, sizeof(staged) - skip)) {
+                break;
+            }
+
+            if (row == 0) {
+                flash_erase_reset_blk();
+            } else if (!flash_blk_blank(row)) {
+                flash_erase_blk(row);
+            }
+            write_flash(addr, staged, sizeof(staged));
+            if (!flash_flush()) {
+                break;
+            }
+            while (flash_bad_row() >= 0);
+        }
+        if (!tries) {
+            return false;
+        }
+    }
+
+#if BOOT_TOKEN
+    boot_token_init(token_counter + 1);
+    flash_flush();
+#endif
+    install_mark(1);
+    return true;
+}
+#endif
+
+/*
+ * Follows the ack of a C message: the number of rows reported, then the
+ * CRC32 of each row as image_read_row() sees it, big endian. Rows the
+ * first write erases with the metadata are reported erased until then.
+ */
+static void row_crcs_send(const uint8_t *data) {
+    uint16_t row = (uint16_t)data[0] << 8 | data[1];
+    uint16_t count = data[2];
+    uint8_t flread[FLASH_BLOCK_SIZ];
+    uint32_t crc;
+
+    if (row >= APP_ROWS) {
+        count = 0;
+    } else if (count > APP_ROWS - row) {
+        count = APP_ROWS - row;
+    }
+
+    uart_write_byte((uint8_t)count);
+    for (; count; count--, row++) {
+        if (row >= APP_END_OFFSET / FLASH_BLOCK_SIZ && !row_is_erased(row)) {
+            /* the first write erases it along with the metadata */
+            memset(flread, 0xff, sizeof(flread));
+        } else {
+            image_read_row(RX_SLOT, row, flread);
+        }
+        crc = crc32_update(0, flread, sizeof(flread));
+
+        uart_write_byte((uint8_t)(crc >> 24));
+        uart_write_byte((uint8_t)(crc >> 16));
+        uart_write_byte((uint8_t)(crc >> 8));
+        uart_write_byte((uint8_t)crc);
+    }
+}
+
+/*
+ * Follows the ack of an H message: the number of rows hashed, 2 bytes big
+ * endian, then the start of the SHA256 of those application rows as
+ * image_read_row() sees them, staged ones or not. Rows past the bootloader
+ * offset are left out.
+ */
+static void rows_hash_send(const uint8_t *data) {
+    uint16_t row = (uint16_t)data[0] << 8 | data[1];
+    uint16_t count = (uint16_t)data[2] << 8 | data[3];
+    uint8_t flread[FLASH_BLOCK_SIZ];
+    SHA256_CTX ctx;
+    BYTE hash[SHA256_BLOCK_SIZE];
+
+    if (row >= APP_ROWS) {
+        count = 0;
+    } else if (count > APP_ROWS - row) {
+        count = APP_ROWS - row;
+    }
+
+    uart_write_byte((uint8_t)(count >> 8));
+    uart_write_byte((uint8_t)count);
+
+    sha256_init(&ctx);
+    for (; count; count--, row++) {
+        image_read_row(0, row, flread);
+        sha256_update(&ctx, flread, sizeof(flread));
+    }
+    sha256_final(&ctx, hash);
+
+    uart_send_buf(hash, ROWS_HASH_SIZE);
+}
+
+/* writes the data of a D or Z message */
+static enum flashing_status data_write(uint24_t addr, const uint8_t *buf, uint8_t cnt) {
+    enum flashing_status status;
+    int ret;
+
+    if (addr + cnt >= APP_END_OFFSET) {
+        return STATUS_ERR_DENIED_ADDR;
+    }
+
+    image_invalidate();
+    /* rows not erased with E, only the changed ones in a differential update */
+    status = rows_erase((uint16_t)(addr / FLASH_BLOCK_SIZ),
+                        (uint16_t)((addr + cnt - 1) / FLASH_BLOCK_SIZ - addr / FLASH_BLOCK_SIZ + 1));
+    if (status != STATUS_NO_ERR) {
+        return status;
+    }
+
+    if (addr == 0) {
+        /* TODO: check if GOTO */
+        /* TODO: check if 4 -7 is only 0xFF */
+        /* flash user code GOTO */
+        ret = write_flash(RX_SLOT + 4, buf, 4);
+        /* skip address 4 to 7 and flash what starts at offset 8 */
+        if (cnt > 8) {
+            ret = write_flash(RX_SLOT + 8, buf + 8, cnt - 8);
+        }
+    } else {
+        ret = write_flash(RX_SLOT + addr, buf, cnt);
+    }
+    rx_hash_data(addr, cnt);
+
+    /* a row before this data didn't program, this data is kept */
+    return ret ? STATUS_ERR_VERIFY : STATUS_NO_ERR;
+}
+
 enum flashing_status message_handle(uint8_t op, uint8_t *data, size_t len) {
     uint24_t addr = 0;
+    uint8_t unpacked[FLASH_BLOCK_SIZ];
+    int unpacked_size;
+    size_t unpacked_max;
 
     switch(op) {
         case HOST_MSG_PROGRAM_SIZE:
             if (len != CODE_SIZE_BYTES) {
                 return STATUS_ERR_INVALID_PAYLOAD;
             }
-            write_flash(CODE_SIZE_OFFSET, data, CODE_SIZE_BYTES);
+            image_invalidate();
+            if (write_flash(RX_SLOT + CODE_SIZE_OFFSET, data, CODE_SIZE_BYTES)) {
+                return STATUS_ERR_VERIFY;
+            }
             break;
         case HOST_MSG_PROGRAM_SIGNAT:
             if (len != SIGNAT_SIZE) {
@@ -88,7 +740,10 @@ enum flashing_status message_handle(uint8_t op, uint8_t *data, size_t len) {
             uart_send_buf(print, strlen(print));
 #endif
 
-            write_flash(SIGNAT_OFFSET, data, SIGNAT_SIZE);
+            image_invalidate();
+            if (write_flash(RX_SLOT + SIGNAT_OFFSET, data, SIGNAT_SIZE)) {
+                return STATUS_ERR_VERIFY;
+            }
             break;
         case HOST_MSG_FLASH_DATA:
             if (len < 5) { /* 1 byte cnt, 3 bytes addr, 1 data min */
@@ -97,29 +752,66 @@ enum flashing_status message_handle(uint8_t op, uint8_t *data, size_t len) {
 
             uint8_t payload_size = data[0];
 
+            if (len != (size_t)HOST_MSG_DATA_PAYLOAD_OFFSET + payload_size) {
+                return STATUS_ERR_INVALID_PAYLOAD;
+            }
+
             addr = (uint24_t)data[1] << 16 | (uint24_t)data[2] << 8 | data[3];
 
-            if (addr + payload_size >= SIGNAT_OFFSET) {
+            return data_write(addr, &data[HOST_MSG_DATA_PAYLOAD_OFFSET], payload_size);
+        case HOST_MSG_FLASH_PACKED:
+            /* 3 bytes addr, then the LZSS data of at most the rest of the row */
+            if (len <= HOST_MSG_PACKED_PAYLOAD_OFFSET) {
+                return STATUS_ERR_INVALID_PAYLOAD;
+            }
+
+            addr = (uint24_t)data[0] << 16 | (uint24_t)data[1] << 8 | data[2];
+            if (addr >= APP_END_OFFSET) {
                 return STATUS_ERR_DENIED_ADDR;
             }
 
-            if (addr == 0) {
-                /* TODO: check if GOTO */
-                /* TODO: check if 4 -7 is only 0xFF */
-                /* flash user code GOTO */
-                write_flash(4, &data[HOST_MSG_DATA_PAYLOAD_OFFSET], 4);
-                /* skip address 4 to 7 and flash what starts at offset 8 */
-                if (payload_size > 8) {
-                    write_flash(8, &data[HOST_MSG_DATA_PAYLOAD_OFFSET + 8], payload_size - 8);
-                }
-                break;
+            /* within the row and the application area, back-references within the slot */
+            unpacked_max = FLASH_BLOCK_SIZ - addr % FLASH_BLOCK_SIZ;
+            if (unpacked_max > APP_END_OFFSET - addr) {
+                unpacked_max = APP_END_OFFSET - addr;
+            }
+            unpacked_size = lz_unpack(RX_SLOT, RX_SLOT + addr, &data[HOST_MSG_PACKED_PAYLOAD_OFFSET],
+                                      len - HOST_MSG_PACKED_PAYLOAD_OFFSET, unpacked, unpacked_max);
+            if (unpacked_size <= 0) {
+                return STATUS_ERR_INVALID_PAYLOAD;
+            }
+
+            return data_write(addr, unpacked, (uint8_t)unpacked_size);
+        case HOST_MSG_ERASE:
+            image_invalidate();
+            /* no payload for the application rows not erased yet, or first row and row count */
+            if (len == 0) {
+                return rows_erase(0, APP_ROWS);
+            }
+            if (len != 4) {
+                return STATUS_ERR_INVALID_PAYLOAD;
+            }
+            return rows_erase((uint16_t)data[0] << 8 | data[1], (uint16_t)data[2] << 8 | data[3]);
+        case HOST_MSG_ROW_CRC:
+            /* first row and row count, answered after the ack */
+            if (len != 3) {
+                return STATUS_ERR_INVALID_PAYLOAD;
+            }
+            break;
+        case HOST_MSG_ROWS_HASH:
+            /* first row and row count, answered after the ack */
+            if (len != 4) {
+                return STATUS_ERR_INVALID_PAYLOAD;
             }
-            write_flash(addr, &data[HOST_MSG_DATA_PAYLOAD_OFFSET], payload_size);
             break;
         case HOST_MSG_FLASH_STOP:
             if (len > 0) {
                 return STATUS_ERR_INVALID_PAYLOAD;
             }
+            /* the last row written has to program before the session ends */
+            if (flash_flush()) {
+                return STATUS_ERR_VERIFY;
+            }
             return STATUS_FLASHING_DONE;
         default:
             return STATUS_ERR_INVALID_PAYLOAD;
@@ -128,8 +820,117 @@ enum flashing_status message_handle(uint8_t op, uint8_t *data, size_t len) {
     return STATUS_NO_ERR;
 }
 
-enum flashing_status fw_receive(void) {
-    uint8_t msg[70];
+/* the host sends the handshake again at the new speed, or both go back */
+static bool baud_check(enum uart_baud baud) {
+    uart_set_baud(baud);
+    if (uart_expect_msg(HOST_HANDSHAKE_MSG, strlen(HOST_HANDSHAKE_MSG), HOST_BAUD_CHECK_TIMEOUT_US)) {
+        uart_set_baud(UART_BAUD_DEFAULT);
+        return false;
+    }
+    uart_send_buf((uint8_t *)MCU_HANDSHAKE_RESP, strlen(MCU_HANDSHAKE_RESP));
+    return true;
+}
+
+/*
+ * Session setup right after the handshake. The host sends requests of "@",
+ * an option letter, its value as a digit and "\n". The bootloader echoes
+ * each one with the value it takes, 0 for one it can't make out:
+ * - S asks for one of the enum uart_baud speeds. After the echo, both
+ *   switch and the host repeats the handshake at the new speed. When that
+ *   doesn't come through in time, both go back to the default speed and
+ *   the host may ask for a slower one. The host only sends it once sure the
+ *   bootloader gave up, so the wait for it is longer.
+ * - F picks one of the enum framing formats and ends the setup.
+ * Without a request in time, or with a message from a host that skips the
+ * setup, the setup ends with the escaped framing.
+ */
+static enum framing session_setup(void) {
+    uint8_t req[3] = {0};
+    uint8_t value;
+    uint8_t windows = 1;
+    int ret;
+
+    for (;;) {
+        while (uart_expect_msg(HOST_SETUP_MSG, strlen(HOST_SETUP_MSG), HOST_SETUP_TIMEOUT_US)) {
+            if (!--windows) {
+                return FRAMING_ESCAPED;
+            }
+        }
+
+        windows = 1;
+        value = 0;
+        ret = uart_get_byte(&req[0], HOST_SETUP_TIMEOUT_US, false);
+        if (!ret && req[0] != HOST_SETUP_SPEED && req[0] != HOST_SETUP_FRAMING) {
+            /* a host skipping the setup, its first message started */
+            uart_unget_byte(req[0]);
+            uart_unget_byte(HOST_MSG_START);
+            return FRAMING_ESCAPED;
+        }
+
+        if (!ret &&
+            !uart_get_byte(&req[1], HOST_SETUP_TIMEOUT_US, false) &&
+            !uart_get_byte(&req[2], HOST_SETUP_TIMEOUT_US, false) &&
+            req[1] >= '0' && req[1] <= '9' && req[2] == '\n') {
+            value = req[1] - '0';
+        }
+
+        if ((req[0] == HOST_SETUP_SPEED && value >= UART_BAUD_COUNT) ||
+            (req[0] == HOST_SETUP_FRAMING && value >= FRAMING_COUNT)) {
+            value = 0;
+        }
+
+        uart_send_buf((uint8_t *)HOST_SETUP_MSG, strlen(HOST_SETUP_MSG));
+        uart_write_byte(req[0]);
+        uart_write_byte('0' + value);
+        uart_write_byte('\n');
+
+        if (req[0] == HOST_SETUP_SPEED && value != UART_BAUD_DEFAULT) {
+            if (!baud_check(value)) {
+                windows = HOST_SETUP_RETRY_WINDOWS;
+            }
+        } else if (req[0] == HOST_SETUP_FRAMING) {
+            return value;
+        }
+    }
+}
+
+/*
+ * Checks the length and CRC of the message received in msg, with the end
+ * byte at msg[end]. Returns the payload length, or -1 if it got damaged.
+ */
+static int msg_check(const uint8_t *msg, size_t end) {
+    size_t len;
+    uint16_t crc;
+
+    /* bytes of this or an earlier message got dropped, the host resends */
+    if (uart_rx_lost()) {
+        return -1;
+    }
+
+    if (end < HOST_MSG_HEADER_SIZE + HOST_MSG_CRC_SIZE) {
+        return -1;
+    }
+
+    len = end - HOST_MSG_HEADER_SIZE - HOST_MSG_CRC_SIZE;
+    if (msg[3] != len) {
+        return -1;
+    }
+
+    crc = crc16_update(CRC16_INIT, msg + 1, HOST_MSG_HEADER_SIZE - 1 + len);
+    if (msg[end - 2] != (uint8_t)(crc >> 8) || msg[end - 1] != (uint8_t)crc) {
+        return -1;
+    }
+
+    return (int)len;
+}
+
+#define HOST_MSG_BUF_SIZE (HOST_MSG_HEADER_SIZE + HOST_MSG_MAX_PAYLOAD + HOST_MSG_CRC_SIZE + 1)
+
+/*
+ * Receives an escaped @ ... \n message into msg, without the escape bytes.
+ * Returns the index of the end byte.
+ */
+static size_t msg_receive_escaped(uint8_t *msg) {
     uint8_t byte;
     size_t i = 0;
     bool escaped = false;
@@ -147,140 +948,165 @@ enum flashing_status fw_receive(void) {
 
         if (escaped) {
             escaped = false;
-            i++;
-            if (i == sizeof(msg)) {
-                i = 0;
-            }
-            continue;
-        }
-
-        if (byte == HOST_MSG_START && i > 0) {
+        } else if (byte == HOST_MSG_START && i > 0) {
             /* unexpected start of message, reset buffer */
             i = 1;
             msg[0] = HOST_MSG_START;
             continue;
+        } else if (msg[i] == HOST_MSG_END && msg[0] == HOST_MSG_START) {
+            return i;
         }
 
-        if (msg[i] == HOST_MSG_END && msg[0] == HOST_MSG_START) {
-            if (i > 1) { /* at least the opcode as payload */
-                /* should check if byte cnt matches data received cnt */
-                enum flashing_status status = message_handle(msg[1], msg + 2, i - 2);
-                if (status == STATUS_FLASHING_DONE || status != STATUS_NO_ERR) {
-                    return status;
-                }
-            }
+        i++;
+        if (i == HOST_MSG_BUF_SIZE) {
             i = 0;
-            uart_write_byte(MCU_MSG_OP_SUCCESS);
-        } else {
-            i++;
-            if (i == sizeof(msg)) {
-                i = 0;
-            }
         }
     }
 }
 
-int signature_valid() {
-    uint24_t siz = 0;
-    uint8_t d[CODE_SIZE_BYTES];
-    uint8_t signat[SIGNAT_SIZE];
-    size_t i;
-    SHA256_CTX ctx;
-    BYTE cksum[SHA256_BLOCK_SIZE];
-    uint8_t flread[64];
-    uint24_t addr = 0;
-    const struct uECC_Curve_t * curve = uECC_secp256k1();
-#ifdef DEBUG
-    char print[SIGNAT_SIZE * 2 + 20];
-#endif
-
-    sha256_init(&ctx);
-
-    read_flash(CODE_SIZE_OFFSET, d, sizeof(d));
-
-    siz = ((uint24_t)d[0] << 16) | ((uint24_t)d[1] << 8) | d[2] ;
-
-#ifdef DEBUG
-    snprintf(print, sizeof(print) - 1, "fw_siz: %lu\n\0", siz);
-    uart_send_buf(print, strlen(print));
-#endif
-
-    read_flash(addr, flread, sizeof(flread));
-    siz -= sizeof(flread);
-    addr += sizeof(flread);
-
-    /* checksum goto user code as being at addr 0, and 
-     * addr 4-8 put 0xff as in original hex */
-    flread[0] = flread[4];
-    flread[1] = flread[5];
-    flread[2] = flread[6];
-    flread[3] = flread[7];
-
-    memset(flread + 4, 0xff, 4);
+/*
+ * Receives a COBS message into msg, laid out like msg_receive_escaped()
+ * leaves it: a start byte, then the decoded bytes. Every code byte tells
+ * how far the next 0 byte is, so 0 only shows up as the message end and
+ * nothing needs escaping. Returns the index past the decoded bytes, 0 for
+ * a message cut short or too long.
+ */
+static size_t msg_receive_cobs(uint8_t *msg) {
+    uint8_t byte;
+    uint8_t code = 0xff;
+    uint8_t left = 0;
+    size_t i = 1;
 
-#ifdef DEBUG
-    for (i = 0; i < 8; i++) {
-        snprintf(print, sizeof(print) - 1, "print[%d]: 0x%02X\n\0", i, flread[i]);
-        uart_send_buf(print, strlen(print));
-    }
-#endif
+    msg[0] = HOST_MSG_START;
+    while (1) {
+        uart_get_byte(&byte, 0, true);
 
-    sha256_update(&ctx, flread, sizeof(flread));
+        if (byte == HOST_MSG_COBS_END) {
+            if (i == 1 && !left) {
+                /* nothing in between */
+                continue;
+            }
+            return left || i > HOST_MSG_BUF_SIZE ? 0 : i;
+        }
 
-    while (siz >= sizeof(flread)) {
-        read_flash(addr, flread, sizeof(flread));
-        siz -= sizeof(flread);
-        addr += sizeof(flread);
-        sha256_update(&ctx, flread, sizeof(flread));
-    }
-    if (siz) {
-        read_flash(addr, flread, (size_t)siz);
-        sha256_update(&ctx, flread, (size_t)siz);
+        if (i >= HOST_MSG_BUF_SIZE) {
+            /* too long, dropped up to the end byte */
+            i = HOST_MSG_BUF_SIZE + 1;
+        } else if (left) {
+            msg[i++] = byte;
+            left--;
+        } else {
+            /* a code byte, the block before it ended with a 0 unless full */
+            if (code != 0xff) {
+                msg[i++] = 0;
+            }
+            code = byte;
+            left = byte - 1;
+        }
     }
+}
 
-    sha256_final(&ctx, cksum);
+/*
+ * Messages carry a sequence number, so the host can send several of them
+ * without waiting for each reply. Only the next expected one is handled,
+ * others are dropped and the host sends them again once it misses the ack.
+ * The ack is the F byte followed by the sequence number of the last handled
+ * message, so it also covers all the ones before it. A dropped message gets
+ * that ack again, so a host whose ack got lost learns where to go on from.
+ *
+ * A message with a bad length or CRC, e.g. one that lost bytes while the
+ * CPU was stalled by a flash write, gets an R byte followed by the expected
+ * sequence number, asking the host to send again from there. Only the first
+ * damaged message is answered, the rest of the window is on its way already.
+ *
+ * With RTS/CTS flow control wired, the host is held while a message is
+ * handled, so it can send a whole window without losing bytes.
+ *
+ * Each flash row that reads back different after programming gets a V byte
+ * and the row number before the ack. The row is erased again the next
+ * time the host writes or erases it.
+ */
+enum flashing_status fw_receive(enum framing framing) {
+    uint8_t msg[HOST_MSG_BUF_SIZE];
+    uint8_t seq = 0;
+    bool resend_asked = false;
+    size_t end;
+    int len;
+    int row;
 
-    read_flash(SIGNAT_OFFSET, signat, sizeof(signat));
+    while (1) {
+        end = framing == FRAMING_COBS ? msg_receive_cobs(msg) : msg_receive_escaped(msg);
 
-#ifdef DEBUG
-    char *p_buf = print;
-    memcpy(p_buf, "sha256: ", strlen("sha256: "));
-    p_buf += strlen("sha256: ");
-    for (i = 0; i < SHA256_BLOCK_SIZE; i++) {
-        sprintf(p_buf, "%02X", cksum[i]);
-        p_buf += 2;
-    }
-    memcpy(p_buf, "\n\0", 2);
-    uart_send_buf(print, strlen(print));
+        len = msg_check(msg, end);
+        if (len < 0) {
+            if (!resend_asked) {
+                uart_write_byte(MCU_MSG_RESEND);
+                uart_write_byte(seq);
+                resend_asked = true;
+            }
+        } else if (msg[2] == seq) {
+            enum flashing_status status;
 
-    p_buf = print;
-    memcpy(p_buf, "signat: ", strlen("signat: "));
-    p_buf += strlen("signat: ");
-    for (i = 0; i < SIGNAT_SIZE; i++) {
-        sprintf(p_buf, "%02X", signat[i]);
-        p_buf += 2;
+            /* flash writes and hashing leave the UART unread meanwhile */
+            uart_rx_hold();
+            status = message_handle(msg[1], msg + HOST_MSG_HEADER_SIZE, (size_t)len);
+            uart_rx_release();
+            if (status != STATUS_NO_ERR && status != STATUS_ERR_VERIFY) {
+                return status;
+            }
+            /* every row that didn't program, whichever step of the message programmed it */
+            while ((row = flash_bad_row()) >= 0) {
+                row -= RX_SLOT / FLASH_BLOCK_SIZ;
+                row_set_unerased((uint16_t)row);
+                uart_write_byte(MCU_ERR_VERIFY);
+                uart_write_byte((uint8_t)(row >> 8));
+                uart_write_byte((uint8_t)row);
+            }
+            uart_write_byte(MCU_MSG_OP_SUCCESS);
+            uart_write_byte(seq);
+            if (msg[1] == HOST_MSG_ROW_CRC) {
+                row_crcs_send(msg + HOST_MSG_HEADER_SIZE);
+            } else if (msg[1] == HOST_MSG_ROWS_HASH) {
+                rows_hash_send(msg + HOST_MSG_HEADER_SIZE);
+            }
+            seq++;
+            resend_asked = false;
+        } else {
+            uart_write_byte(MCU_MSG_OP_SUCCESS);
+            uart_write_byte((uint8_t)(seq - 1));
+        }
     }
-    memcpy(p_buf, "\n\0", 2);
-    uart_send_buf(print, strlen(print));
-    return 0;
-#else
-    return uECC_verify(ec_pub_key, cksum, SHA256_BLOCK_SIZE, signat, curve);
-#endif
 }
 
 void main(void) {
-    uint8_t byte;
     int ret;
     enum flashing_status status;
+    BYTE cksum[SHA256_BLOCK_SIZE];
 
     mcu_init();
     uart_init(RX_STATE_DISABLED);
 
+#ifdef STAGING_OFFSET
+    /* the application is incomplete until then, a session would stage over its source */
+    if (install_pending()) {
+        image_install();
+    }
+#endif
+
     uart_rx_enable();
     ret = uart_expect_msg(HOST_HANDSHAKE_MSG, 5, 60000);
     if (ret) {
         /* nothing interesting from PC, booting old code */
-        if (signature_valid()) {
+#if BOOT_TOKEN
+        if (boot_token_valid()) {
+            uart_write_byte(MCU_MSG_SIG_CHECK_OK);
+            asm("goto 4"); /* image verified on a previous boot */
+        }
+#endif
+        if (signature_valid(cksum)) {
+#if BOOT_TOKEN
+            boot_token_write();
+#endif
             uart_write_byte(MCU_MSG_SIG_CHECK_OK);
             asm("goto 4"); /* jump to user code */
         } else {
@@ -291,13 +1117,40 @@ void main(void) {
 
 
     uart_rx_disable();
-    erase_flash(BTLD_OFFSET);
+    rx_hash_init();
+    rows_init();
 
     uart_send_buf((uint8_t *)MCU_HANDSHAKE_RESP, strlen(MCU_HANDSHAKE_RESP));
 
     uart_rx_enable();
-    status = fw_receive();
-    if (status != STATUS_NO_ERR) {
+    status = fw_receive(session_setup());
+    flash_flush();
+    if (status == STATUS_FLASHING_DONE) {
+#ifdef STAGING_OFFSET
+        /* staged in this session, or else only queried: report the application */
+        if (!row_is_erased(APP_ROWS - 1)) {
+            ret = signature_valid(cksum);
+        } else if ((ret = image_verify(cksum))) {
+            install_mark(0);
+            ret = image_install();
+#if BOOT_TOKEN
+            if (ret) {
+                boot_token_write();
+            }
+#endif
+        }
+#else
+        /* reject a bad image right away, a good one won't be hashed again at boot */
+        ret = image_verify(cksum);
+#if BOOT_TOKEN
+        /* still there after a session that only queried the flash */
+        if (ret && !boot_token_valid()) {
+            boot_token_write();
+        }
+#endif
+#endif
+        uart_write_byte(ret ? MCU_MSG_SIG_CHECK_OK : MCU_MSG_SIG_CHECK_FAIL);
+    } else if (status != STATUS_NO_ERR) {
         uart_write_byte(mcu_errs[status]);
     }
 
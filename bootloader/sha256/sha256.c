@@ -16,6 +16,14 @@
 #include <stdlib.h>
 //#include <memory.h>
 #include "sha256.h"
+#include "../flash/flash.h"
+
+#ifdef BTLD_PROBES
+#include "probes.h"
+#else
+#define PROBE_ENTER(id)
+#define PROBE_EXIT(id)
+#endif
 
 /****************************** MACROS ******************************/
 #define ROTLEFT(a,b) (((a) << (b)) | ((a) >> (32-(b))))
@@ -23,10 +31,32 @@
 
 #define CH(x,y,z) (((x) & (y)) ^ (~(x) & (z)))
 #define MAJ(x,y,z) (((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
+
+// 8 bit targets shift 32 bit words one bit at a time, so a rotation by
+// 8 * n + r bits is done as a byte permutation plus at most 3 single bit
+// rotations. Little endian targets only.
+#ifndef SHA256_BYTE_ROTATE
+#ifdef __XC8
+#define SHA256_BYTE_ROTATE 1
+#else
+#define SHA256_BYTE_ROTATE 0
+#endif
+#endif
+
+#if SHA256_BYTE_ROTATE
+#define EP0(x) ep0(x)
+#define EP1(x) ep1(x)
+#define SIG0(x) sig0(x)
+#define SIG1(x) sig1(x)
+#else
 #define EP0(x) (ROTRIGHT(x,2) ^ ROTRIGHT(x,13) ^ ROTRIGHT(x,22))
 #define EP1(x) (ROTRIGHT(x,6) ^ ROTRIGHT(x,11) ^ ROTRIGHT(x,25))
 #define SIG0(x) (ROTRIGHT(x,7) ^ ROTRIGHT(x,18) ^ ((x) >> 3))
 #define SIG1(x) (ROTRIGHT(x,17) ^ ROTRIGHT(x,19) ^ ((x) >> 10))
+#endif
+
+// Index of message schedule word i in the 16 word circular window.
+#define W(i) m[(i) & 15]
 
 /**************************** VARIABLES *****************************/
 static const WORD k[64] = {
@@ -41,14 +71,95 @@ static const WORD k[64] = {
 };
 
 /*********************** FUNCTION DEFINITIONS ***********************/
-void sha256_transform(SHA256_CTX *ctx, const BYTE data[])
+#if SHA256_BYTE_ROTATE
+typedef union {
+	WORD w;
+	BYTE b[4];
+} WORD_BYTES;
+
+static WORD rotr8(WORD x)
 {
-	WORD a, b, c, d, e, f, g, h, i, j, t1, t2, m[64];
+	WORD_BYTES in, out;
 
-	for (i = 0, j = 0; i < 16; ++i, j += 4)
-		m[i] = ((unsigned long)data[j] << 24) | ((unsigned long)data[j + 1] << 16) | ((unsigned long)data[j + 2] << 8) | ((unsigned long)data[j + 3]);
-	for ( ; i < 64; ++i)
-		m[i] = SIG1(m[i - 2]) + m[i - 7] + SIG0(m[i - 15]) + m[i - 16];
+	in.w = x;
+	out.b[0] = in.b[1];
+	out.b[1] = in.b[2];
+	out.b[2] = in.b[3];
+	out.b[3] = in.b[0];
+	return out.w;
+}
+
+static WORD rotr16(WORD x)
+{
+	WORD_BYTES in, out;
+
+	in.w = x;
+	out.b[0] = in.b[2];
+	out.b[1] = in.b[3];
+	out.b[2] = in.b[0];
+	out.b[3] = in.b[1];
+	return out.w;
+}
+
+static WORD rotr24(WORD x)
+{
+	WORD_BYTES in, out;
+
+	in.w = x;
+	out.b[0] = in.b[3];
+	out.b[1] = in.b[0];
+	out.b[2] = in.b[1];
+	out.b[3] = in.b[2];
+	return out.w;
+}
+
+static WORD rotr1(WORD x)
+{
+	return (x & 1) ? (x >> 1) | 0x80000000 : x >> 1;
+}
+
+static WORD rotl1(WORD x)
+{
+	return (x & 0x80000000) ? (x << 1) | 1 : x << 1;
+}
+
+// rotr 2 ^ rotr 13 ^ rotr 22
+static WORD ep0(WORD x)
+{
+	return rotr1(rotr1(x)) ^ rotl1(rotl1(rotl1(rotr16(x)))) ^ rotl1(rotl1(rotr24(x)));
+}
+
+// rotr 6 ^ rotr 11 ^ rotr 25
+static WORD ep1(WORD x)
+{
+	WORD r8 = rotr8(x);
+
+	return rotl1(rotl1(r8)) ^ rotr1(rotr1(rotr1(r8))) ^ rotr1(rotr24(x));
+}
+
+// rotr 7 ^ rotr 18 ^ shr 3
+static WORD sig0(WORD x)
+{
+	return rotl1(rotr8(x)) ^ rotr1(rotr1(rotr16(x))) ^ (x >> 3);
+}
+
+// rotr 17 ^ rotr 19 ^ shr 10
+static WORD sig1(WORD x)
+{
+	WORD r17 = rotr1(rotr16(x));
+
+	return r17 ^ rotr1(rotr1(r17)) ^ ((rotr8(x) & 0x00ffffff) >> 2);
+}
+#endif
+
+// Runs the compression on a block already loaded, big endian, in m[0] - m[15].
+// The rest of the message schedule is expanded in place as the rounds need
+// it, so m only ever holds the last 16 words.
+static void sha256_compress(SHA256_CTX *ctx, WORD m[])
+{
+	WORD a, b, c, d, e, f, g, h, i, t1, t2;
+
+	PROBE_ENTER(PROBE_SHA256_TRANSFORM);
 
 	a = ctx->state[0];
 	b = ctx->state[1];
@@ -60,7 +171,9 @@ void sha256_transform(SHA256_CTX *ctx, const BYTE data[])
 	h = ctx->state[7];
 
 	for (i = 0; i < 64; ++i) {
-		t1 = h + EP1(e) + CH(e,f,g) + k[i] + m[i];
+		if (i >= 16)
+			W(i) = SIG1(W(i - 2)) + W(i - 7) + SIG0(W(i - 15)) + W(i);
+		t1 = h + EP1(e) + CH(e,f,g) + k[i] + W(i);
 		t2 = EP0(a) + MAJ(a,b,c);
 		h = g;
 		g = f;
@@ -80,6 +193,18 @@ void sha256_transform(SHA256_CTX *ctx, const BYTE data[])
 	ctx->state[5] += f;
 	ctx->state[6] += g;
 	ctx->state[7] += h;
+
+	PROBE_EXIT(PROBE_SHA256_TRANSFORM);
+}
+
+void sha256_transform(SHA256_CTX *ctx, const BYTE data[])
+{
+	WORD i, j, m[16];
+
+	for (i = 0, j = 0; i < 16; ++i, j += 4)
+		m[i] = ((unsigned long)data[j] << 24) | ((unsigned long)data[j + 1] << 16) | ((unsigned long)data[j + 2] << 8) | ((unsigned long)data[j + 3]);
+
+	sha256_compress(ctx, m);
 }
 
 void sha256_init(SHA256_CTX *ctx)
@@ -111,6 +236,43 @@ void sha256_update(SHA256_CTX *ctx, const BYTE data[], size_t len)
 	}
 }
 
+// Hashes len bytes of program memory from addr. Whole blocks go from TBLRD
+// straight into the message schedule, only a partial head or tail goes
+// through ctx->data.
+void sha256_update_flash(SHA256_CTX *ctx, uint24_t addr, size_t len)
+{
+	WORD m[16];
+	size_t cnt;
+
+	if (ctx->datalen) {
+		cnt = 64 - ctx->datalen;
+		if (cnt > len)
+			cnt = len;
+		read_flash(addr, &ctx->data[ctx->datalen], cnt);
+		ctx->datalen += cnt;
+		addr += cnt;
+		len -= cnt;
+		if (ctx->datalen < 64)
+			return;
+		sha256_transform(ctx, ctx->data);
+		ctx->bitlen += 512;
+		ctx->datalen = 0;
+	}
+
+	while (len >= 64) {
+		read_flash_be32(addr, m, 16);
+		sha256_compress(ctx, m);
+		ctx->bitlen += 512;
+		addr += 64;
+		len -= 64;
+	}
+
+	if (len) {
+		read_flash(addr, ctx->data, len);
+		ctx->datalen = len;
+	}
+}
+
 void sha256_final(SHA256_CTX *ctx, BYTE hash[])
 {
 	WORD i;
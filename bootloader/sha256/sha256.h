@@ -14,13 +14,15 @@ extern "C" {
 
 /*************************** HEADER FILES ***************************/
 #include <stddef.h>
+#include <stdint.h>
 #include <string.h>
+#include <xc.h>
 /****************************** MACROS ******************************/
 #define SHA256_BLOCK_SIZE 32            // SHA256 outputs a 32 byte digest
 
 /**************************** DATA TYPES ****************************/
 typedef unsigned char BYTE;             // 8-bit byte
-typedef unsigned long  WORD;             // 32-bit word, change to "long" for 16-bit machines
+typedef uint32_t WORD;                  // 32-bit word, also on 64-bit hosts
 
 typedef struct {
 	BYTE data[64];
@@ -32,6 +34,7 @@ typedef struct {
 /*********************** FUNCTION DECLARATIONS **********************/
 void sha256_init(SHA256_CTX *ctx);
 void sha256_update(SHA256_CTX *ctx, const BYTE data[], size_t len);
+void sha256_update_flash(SHA256_CTX *ctx, uint24_t addr, size_t len);
 void sha256_final(SHA256_CTX *ctx, BYTE hash[]);
 
 #ifdef	__cplusplus
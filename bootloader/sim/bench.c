@@ -0,0 +1,177 @@
+/*
+ * File:   bench.c
+ *
+ * Boot time benchmark: runs signature_valid() from main.c against images
+ * from 4 KB up to the whole 18F25K22 flash and reports, per phase, the
+ * operation counts (deterministic, comparable between commits) and the
+ * host time spent in them.
+ *
+ * The image and signature are pseudo random: the signature doesn't verify,
+ * but uECC_verify() does the same amount of work as for a valid one.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <xc.h>
+
+#include "sim.h"
+#include "probes.h"
+#include "../flash/flash.h"
+#include "../layout.h"
+#include "../sha256/sha256.h"
+#include "../uECC/uECC.h"
+#include "../uECC/types.h"
+
+#define BENCH_MAX_IMAGE (APP_END_OFFSET / FLASH_BLOCK_SIZ * FLASH_BLOCK_SIZ)
+
+struct probe probes[PROBE_COUNT];
+
+static uint32_t lcg_state;
+
+int signature_valid(BYTE cksum[]);
+
+static uint64_t time_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+void probe_enter(enum probe_id id)
+{
+    probes[id].calls++;
+    probes[id].start_ns = time_ns();
+}
+
+void probe_exit(enum probe_id id)
+{
+    probes[id].ns += time_ns() - probes[id].start_ns;
+}
+
+void sim_asm(const char *insn)
+{
+    (void)insn;
+}
+
+void sim_fatal(const char *fmt, ...)
+{
+    va_list ap;
+
+    fprintf(stderr, "bench: ");
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fprintf(stderr, "\n");
+    exit(2);
+}
+
+static uint8_t lcg_byte(void)
+{
+    lcg_state = lcg_state * 1103515245 + 12345;
+    return (uint8_t)(lcg_state >> 16);
+}
+
+static void image_write(uint24_t size)
+{
+    uint8_t buf[FLASH_BLOCK_SIZ];
+    uint8_t signat[SIGNAT_SIZE];
+    uint8_t d[CODE_SIZE_BYTES];
+    uint24_t addr;
+    size_t i;
+
+    /* same image and signature for a given size, whatever else runs */
+    lcg_state = size;
+    flash_erase_reset_blk();
+    for (i = 2; i < BTLD_OFFSET / FLASH_BLOCK_SIZ; i++) {
+        flash_erase_blk(i);
+    }
+
+    for (addr = FLASH_BLOCK_SIZ; addr < size; addr += sizeof(buf)) {
+        size_t cnt = size - addr < sizeof(buf) ? size - addr : sizeof(buf);
+
+        for (i = 0; i < cnt; i++) {
+            buf[i] = lcg_byte();
+        }
+        write_flash(addr, buf, cnt);
+    }
+
+    /* r and s below the curve order */
+    for (i = 0; i < SIGNAT_SIZE; i++) {
+        signat[i] = lcg_byte();
+    }
+    signat[0] &= 0x7f;
+    signat[SIGNAT_SIZE / 2] &= 0x7f;
+    write_flash(SIGNAT_OFFSET, signat, SIGNAT_SIZE);
+
+    d[0] = (uint8_t)(size >> 16);
+    d[1] = (uint8_t)(size >> 8);
+    d[2] = (uint8_t)size;
+    write_flash(CODE_SIZE_OFFSET, d, CODE_SIZE_BYTES);
+}
+
+static void bench(uint24_t size)
+{
+    BYTE cksum[SHA256_BLOCK_SIZE];
+    uint64_t start;
+    int valid;
+
+    image_write(size);
+
+    memset(&sim_stats, 0, sizeof(sim_stats));
+    memset(probes, 0, sizeof(probes));
+
+    start = time_ns();
+    valid = signature_valid(cksum);
+
+    printf("%7lu %8lu %6lu %7lu %6lu %6lu %6lu %5lu %5lu %6lu %6lu %7lu %8lu %s\n",
+           (unsigned long)size, sim_stats.flash_bytes_read,
+           probes[PROBE_SHA256_TRANSFORM].calls,
+           (unsigned long)(probes[PROBE_SHA256_TRANSFORM].ns / 1000),
+           probes[PROBE_VLI_MODINV].calls,
+           probes[PROBE_VLI_MULT].calls,
+           probes[PROBE_VLI_SQUARE].calls,
+           probes[PROBE_POINT_DOUBLE].calls,
+           probes[PROBE_POINT_ADD].calls,
+           (unsigned long)(probes[PROBE_VLI_MODINV].ns / 1000),
+           (unsigned long)(probes[PROBE_VERIFY_TABLE].ns / 1000),
+           (unsigned long)(probes[PROBE_VERIFY_LOOP].ns / 1000),
+           (unsigned long)((time_ns() - start) / 1000),
+           valid ? "valid" : "invalid");
+}
+
+int main(int argc, char **argv)
+{
+    static const uint24_t sizes[] = {4096, 8192, 16384, 24576, BENCH_MAX_IMAGE};
+    size_t i;
+
+    printf("signature_valid() benchmark, uECC word size %d, square func %d, optimization level %d, verify window %d, G window %d\n",
+           uECC_WORD_SIZE, uECC_SQUARE_FUNC, uECC_OPTIMIZATION_LEVEL, uECC_VERIFY_WINDOW,
+           uECC_VERIFY_G_WINDOW);
+    printf("%7s %8s %6s %7s %6s %6s %6s %5s %5s %6s %6s %7s %8s %s\n",
+           "image_B", "flash_rd", "sha_tf", "sha_us", "modinv", "mult", "square",
+           "dbl", "add", "inv_us", "tbl_us", "loop_us", "total_us", "signature");
+
+    if (argc > 1) {
+        for (i = 1; i < (size_t)argc; i++) {
+            uint24_t size = (uint24_t)strtoul(argv[i], NULL, 0);
+
+            if (size < FLASH_BLOCK_SIZ || size > BENCH_MAX_IMAGE) {
+                sim_fatal("image size must be between %d and %lu", FLASH_BLOCK_SIZ,
+                          (unsigned long)BENCH_MAX_IMAGE);
+            }
+            bench(size);
+        }
+        return 0;
+    }
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        bench(sizes[i]);
+    }
+
+    return 0;
+}
@@ -0,0 +1,109 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <xc.h>
+
+#include "sim.h"
+#include "../flash/flash.h"
+#include "../flash/flash_hw.h"
+
+uint8_t sim_flash[SIM_FLASH_SIZE];
+long sim_flash_weak_row = -1;
+
+static void check_range(uint24_t addr, size_t count)
+{
+    if (addr > SIM_FLASH_SIZE || count > SIM_FLASH_SIZE - addr) {
+        sim_fatal("flash access out of range: 0x%06lx + %zu",
+                  (unsigned long)addr, count);
+    }
+}
+
+/*
+ * The flash/flash_hw.c primitives on the in-memory flash, flash/flash.c
+ * runs on top as on the target. Programming only clears bits, exactly like
+ * the real cells do, and stalls the CPU like erasing does.
+ */
+void flash_hw_program_row(uint24_t addr, const uint8_t *buf) {
+    long row = (long)(addr / FLASH_BLOCK_SIZ);
+
+    check_range(addr, FLASH_BLOCK_SIZ);
+
+    for (size_t i = 0; i < FLASH_BLOCK_SIZ; i++) {
+        uint8_t clear = (uint8_t)~buf[i];
+
+        if (row == sim_flash_weak_row && clear) {
+            /* the first bit this programming should clear stays set */
+            clear &= (uint8_t)(clear - 1);
+            sim_flash_weak_row = -1;
+            fprintf(stderr, "sim: row 0x%04lx programmed with a bit left set\n",
+                    (unsigned long)addr);
+        }
+        if (buf[i] != 0xff) {
+            sim_stats.flash_bytes_written++;
+        }
+        sim_flash[addr + i] &= (uint8_t)~clear;
+    }
+    sim_stats.flash_rows_written++;
+    sim_uart_stall(SIM_ROW_WRITE_US);
+}
+
+void flash_hw_erase_row(uint24_t addr)
+{
+    check_range(addr, FLASH_BLOCK_SIZ);
+
+    memset(&sim_flash[addr], 0xff, FLASH_BLOCK_SIZ);
+    sim_stats.flash_rows_erased++;
+    sim_uart_stall(SIM_ROW_ERASE_US);
+}
+
+void flash_hw_read(uint24_t addr, uint8_t *buf, size_t count) {
+    check_range(addr, count);
+
+    memcpy(buf, &sim_flash[addr], count);
+    sim_stats.flash_bytes_read += count;
+}
+
+void flash_hw_read_be32(uint24_t addr, uint32_t *words, size_t count) {
+    const uint8_t *p = &sim_flash[addr];
+
+    check_range(addr, count * 4);
+
+    for (size_t i = 0; i < count; i++, p += 4) {
+        words[i] = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+    }
+    sim_stats.flash_bytes_read += count * 4;
+}
+
+bool flash_hw_row_blank(uint24_t addr) {
+    check_range(addr, FLASH_BLOCK_SIZ);
+
+    sim_stats.flash_bytes_read += FLASH_BLOCK_SIZ;
+    for (size_t i = 0; i < FLASH_BLOCK_SIZ; i++) {
+        if (sim_flash[addr + i] != 0xff) {
+            return false;
+        }
+    }
+    sim_stats.flash_rows_blank++;
+    return true;
+}
+
+bool flash_hw_row_cleared(uint24_t addr, const uint8_t *buf) {
+    check_range(addr, FLASH_BLOCK_SIZ);
+
+    sim_stats.flash_bytes_read += FLASH_BLOCK_SIZ;
+    for (size_t i = 0; i < FLASH_BLOCK_SIZ; i++) {
+        if (sim_flash[addr + i] & (uint8_t)~buf[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void sim_flash_lose_pending(void) {
+    uint24_t addr;
+
+    if (flash_lose_pending(&addr)) {
+        fprintf(stderr, "sim: row 0x%04lx never flushed\n", (unsigned long)addr);
+    }
+}
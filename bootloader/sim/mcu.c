@@ -0,0 +1,19 @@
+#include <time.h>
+
+#include "sim.h"
+#include "../mcu/mcu.h"
+
+struct sim_stats sim_stats;
+
+uint64_t sim_time_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+void mcu_init(void)
+{
+    /* oscillator is always stable in the simulator */
+}
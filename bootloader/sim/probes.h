@@ -0,0 +1,39 @@
+/*
+ * File:   probes.h
+ *
+ * Phase probes for the benchmark build. sha256.c and uECC.c include this
+ * only when BTLD_PROBES is defined, otherwise the probes compile to nothing.
+ */
+
+#ifndef SIM_PROBES_H
+#define	SIM_PROBES_H
+
+#include <stdint.h>
+
+enum probe_id {
+    PROBE_SHA256_TRANSFORM,
+    PROBE_VLI_MULT,
+    PROBE_VLI_SQUARE,
+    PROBE_VLI_MODINV,
+    PROBE_VERIFY_TABLE,
+    PROBE_VERIFY_LOOP,
+    PROBE_POINT_DOUBLE,
+    PROBE_POINT_ADD,
+    PROBE_COUNT,
+};
+
+struct probe {
+    unsigned long calls;
+    uint64_t ns;
+    uint64_t start_ns;
+};
+
+extern struct probe probes[PROBE_COUNT];
+
+void probe_enter(enum probe_id id);
+void probe_exit(enum probe_id id);
+
+#define PROBE_ENTER(id) probe_enter(id)
+#define PROBE_EXIT(id) probe_exit(id)
+
+#endif	/* SIM_PROBES_H */
@@ -0,0 +1,223 @@
+/*
+ * File:   sim.c
+ *
+ * Host simulator driver. Runs the bootloader core (main.c, sha256, uECC)
+ * against the in-memory flash and a pty backed UART, so the flashing tool
+ * can talk to it exactly like to the real MCU:
+ *
+ *   ./bootloader-sim -f flash.bin -w &
+ *   python host/btld.py /dev/pts/N app.hex private-key.pem
+ *
+ * Every MCU reset restarts main(), the flash contents are kept across
+ * resets and optionally across runs (-f). The simulation ends when the
+ * bootloader jumps to user code or after the boot count limit.
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <poll.h>
+#include <setjmp.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <xc.h>
+
+#include "sim.h"
+
+#define SIM_EXIT_RESET 1
+#define SIM_EXIT_USER_CODE 2
+
+static jmp_buf sim_boot_env;
+static const char *flash_file;
+
+void btld_main(void);
+
+static void flash_save(void)
+{
+    FILE *f;
+
+    if (!flash_file) {
+        return;
+    }
+
+    f = fopen(flash_file, "wb");
+    if (!f || fwrite(sim_flash, 1, sizeof(sim_flash), f) != sizeof(sim_flash)) {
+        fprintf(stderr, "sim: can't save flash to %s\n", flash_file);
+    }
+    if (f) {
+        fclose(f);
+    }
+}
+
+void sim_fatal(const char *fmt, ...)
+{
+    va_list ap;
+
+    fprintf(stderr, "sim: ");
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fprintf(stderr, "\n");
+
+    flash_save();
+    exit(2);
+}
+
+void sim_asm(const char *insn)
+{
+    /* a row left in RAM never makes it to flash */
+    sim_flash_lose_pending();
+
+    if (!strcmp(insn, "goto 4")) {
+        longjmp(sim_boot_env, SIM_EXIT_USER_CODE);
+    } else if (!strcmp(insn, "reset")) {
+        longjmp(sim_boot_env, SIM_EXIT_RESET);
+    } else if (strcmp(insn, "nop")) {
+        sim_fatal("unsupported instruction \"%s\"", insn);
+    }
+}
+
+static void flash_load(void)
+{
+    FILE *f;
+    /* GOTO BTLD_OFFSET, as placed at reset vector by tools/btld-patch.py */
+    uint24_t goto_addr = BTLD_OFFSET >> 1;
+
+    memset(sim_flash, 0xff, sizeof(sim_flash));
+    sim_flash[0] = goto_addr & 0xff;
+    sim_flash[1] = 0xef;
+    sim_flash[2] = (goto_addr >> 8) & 0xff;
+    sim_flash[3] = ((goto_addr >> 16) & 0x0f) | 0xf0;
+
+    if (!flash_file) {
+        return;
+    }
+
+    f = fopen(flash_file, "rb");
+    if (f) {
+        if (fread(sim_flash, 1, sizeof(sim_flash), f) != sizeof(sim_flash)) {
+            sim_fatal("%s is not a %lu bytes flash image", flash_file, SIM_FLASH_SIZE);
+        }
+        fclose(f);
+    }
+}
+
+static void uart_open_pty(void)
+{
+    struct termios tio;
+
+    sim_uart_fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (sim_uart_fd < 0 || grantpt(sim_uart_fd) || unlockpt(sim_uart_fd)) {
+        sim_fatal("can't allocate a pty");
+    }
+
+    /* keep the slave open so the host tool can come and go */
+    sim_uart_slave_fd = open(ptsname(sim_uart_fd), O_RDWR | O_NOCTTY);
+    if (sim_uart_slave_fd < 0 || tcgetattr(sim_uart_slave_fd, &tio)) {
+        sim_fatal("can't open %s", ptsname(sim_uart_fd));
+    }
+    cfmakeraw(&tio);
+    cfsetspeed(&tio, B115200);
+    tcsetattr(sim_uart_slave_fd, TCSANOW, &tio);
+
+    fprintf(stderr, "sim: UART on %s\n", ptsname(sim_uart_fd));
+}
+
+static void print_stats(unsigned boot, const char *how, uint64_t elapsed_us)
+{
+    unsigned long stall_us = sim_stats.flash_rows_written * SIM_ROW_WRITE_US +
+                             sim_stats.flash_rows_erased * SIM_ROW_ERASE_US;
+    unsigned long wire_us = (unsigned long)(sim_stats.uart_wire_ns / 1000);
+
+    fprintf(stderr, "sim: boot %u: %s after %llu us\n", boot, how,
+            (unsigned long long)elapsed_us);
+    fprintf(stderr, "sim:   flash: %lu B read, %lu B written, %lu row writes, %lu row erases, %lu blank rows not erased\n",
+            sim_stats.flash_bytes_read, sim_stats.flash_bytes_written,
+            sim_stats.flash_rows_written, sim_stats.flash_rows_erased, sim_stats.flash_rows_blank);
+    fprintf(stderr, "sim:   uart: %lu B rx, %lu B tx, %lu B lost to overruns\n",
+            sim_stats.uart_bytes_rx, sim_stats.uart_bytes_tx, sim_stats.uart_bytes_lost);
+    fprintf(stderr, "sim:   target estimate: %lu us flash stall (%lu Tcy), %lu us on the wire\n",
+            stall_us, stall_us * SIM_TCY_PER_US, wire_us);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-f flash.bin] [-w] [-n max_boots] [-o] [-b max_baud] [-p row]\n"
+                    "  -f  load/save the program flash from/to this file\n"
+                    "  -w  wait for the host to start talking before the first boot\n"
+                    "  -n  stop after this many boots (default 4)\n"
+                    "  -o  don't lose UART bytes received during flash stalls\n"
+                    "  -b  garble UART bytes sent faster than this\n"
+                    "  -p  leave a bit set the first time this flash row is programmed\n", prog);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned max_boots = 4;
+    unsigned boot;
+    bool wait_host = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "f:wn:ob:p:")) != -1) {
+        switch (opt) {
+            case 'f':
+                flash_file = optarg;
+                break;
+            case 'w':
+                wait_host = true;
+                break;
+            case 'n':
+                max_boots = (unsigned)atoi(optarg);
+                break;
+            case 'o':
+                sim_uart_overrun = 0;
+                break;
+            case 'b':
+                sim_line_max_baud = strtoul(optarg, NULL, 10);
+                break;
+            case 'p':
+                sim_flash_weak_row = strtol(optarg, NULL, 0);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    flash_load();
+    uart_open_pty();
+
+    if (wait_host) {
+        struct pollfd pfd = { .fd = sim_uart_fd, .events = POLLIN };
+        poll(&pfd, 1, -1);
+    }
+
+    for (boot = 1; boot <= max_boots; boot++) {
+        volatile uint64_t start = sim_time_us();
+        int how;
+
+        memset(&sim_stats, 0, sizeof(sim_stats));
+
+        how = setjmp(sim_boot_env);
+        if (!how) {
+            btld_main();
+            sim_fatal("main() returned");
+        }
+
+        print_stats(boot, how == SIM_EXIT_USER_CODE ? "jump to user code" : "reset",
+                    sim_time_us() - start);
+        flash_save();
+
+        if (how == SIM_EXIT_USER_CODE) {
+            return 0;
+        }
+    }
+
+    fprintf(stderr, "sim: boot limit reached\n");
+    return 1;
+}
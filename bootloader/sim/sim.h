@@ -0,0 +1,51 @@
+/*
+ * File:   sim.h
+ *
+ * Shared state of the host simulator: the in-memory program flash, the
+ * UART file descriptor and the counters used for profiling.
+ */
+
+#ifndef SIM_H
+#define	SIM_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SIM_FLASH_SIZE (32UL * 1024) /* PIC18F25K22 */
+
+#define SIM_FOSC 64000000UL
+#define SIM_TCY_PER_US (SIM_FOSC / 4 / 1000000)
+
+/* datasheet self-timed write and erase times, CPU is stalled meanwhile */
+#define SIM_ROW_WRITE_US 2000
+#define SIM_ROW_ERASE_US 2000
+
+struct sim_stats {
+    unsigned long flash_bytes_read;
+    unsigned long flash_bytes_written;
+    unsigned long flash_rows_written;
+    unsigned long flash_rows_erased;
+    unsigned long flash_rows_blank;
+    unsigned long uart_bytes_rx;
+    unsigned long uart_bytes_tx;
+    unsigned long uart_bytes_lost;
+    /* at the speed each byte went at */
+    unsigned long long uart_wire_ns;
+};
+
+extern uint8_t sim_flash[SIM_FLASH_SIZE];
+/* row whose next programming leaves a bit set, -1 for none */
+extern long sim_flash_weak_row;
+extern struct sim_stats sim_stats;
+extern int sim_uart_fd;
+extern int sim_uart_slave_fd;
+extern unsigned long sim_baudrate;
+extern unsigned long sim_line_max_baud;
+extern int sim_uart_overrun;
+
+uint64_t sim_time_us(void);
+void sim_fatal(const char *fmt, ...);
+void sim_uart_stall(unsigned long us);
+void sim_flash_lose_pending(void);
+
+#endif	/* SIM_H */
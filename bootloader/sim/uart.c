@@ -0,0 +1,247 @@
+#include <errno.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "sim.h"
+#include "../uart/uart.h"
+
+volatile struct sim_rcsta_bits RCSTA1bits;
+
+int sim_uart_fd = -1;
+/* the host side of the pty, its termios speed is the host UART speed */
+int sim_uart_slave_fd = -1;
+
+static const unsigned long sim_bauds[UART_BAUD_COUNT] = { 115200, 460800, 1000000 };
+unsigned long sim_baudrate = 115200;
+/* fastest speed the line carries, 0 for no limit */
+unsigned long sim_line_max_baud;
+
+/* drop the bytes the real EUSART would lose during flash stalls */
+int sim_uart_overrun = 1;
+
+/* RTS up, a host with flow control holds its bytes back */
+static int rts_held;
+
+/* EUSART receive FIFO, only used across flash stalls */
+#define SIM_RX_FIFO_SIZE 2
+static uint8_t rx_fifo[SIM_RX_FIFO_SIZE];
+static size_t rx_fifo_len;
+
+/* bytes put back by uart_unget_byte(), read before anything else */
+#define SIM_RX_UNGET_SIZE 4
+static uint8_t rx_unget[SIM_RX_UNGET_SIZE];
+static size_t rx_unget_len;
+
+void uart_init(enum rx_state rx_state) {
+    rx_state == RX_STATE_ENABLED ? uart_rx_enable() : uart_rx_disable();
+    uart_set_baud(UART_BAUD_DEFAULT);
+    rts_held = 0;
+    rx_unget_len = 0;
+}
+
+/*
+ * The real bootloader catches in a ring buffer what the adapter sends
+ * after RTS goes up. Here the pty keeps those bytes, so holding only
+ * matters across flash stalls.
+ */
+void uart_rx_hold(void) {
+    rts_held = 1;
+}
+
+void uart_rx_release(void) {
+    rts_held = 0;
+}
+
+/* nothing is dropped while holding, the pty keeps it all */
+bool uart_rx_lost(void) {
+    return false;
+}
+
+void uart_set_baud(enum uart_baud baud) {
+    sim_baudrate = sim_bauds[baud];
+}
+
+/* the host set CRTSCTS on its side of the pty */
+static int sim_uart_host_rtscts(void)
+{
+    struct termios tio;
+
+    return !tcgetattr(sim_uart_slave_fd, &tio) && (tio.c_cflag & CRTSCTS);
+}
+
+static unsigned long sim_uart_host_baud(void)
+{
+    struct termios tio;
+
+    if (tcgetattr(sim_uart_slave_fd, &tio)) {
+        return 0;
+    }
+
+    switch (cfgetospeed(&tio)) {
+        case B115200:
+            return 115200;
+        case B460800:
+            return 460800;
+        case B1000000:
+            return 1000000;
+        default:
+            return 0;
+    }
+}
+
+/*
+ * Bytes cross the line intact only when both ends use the same speed and
+ * the line can carry it, otherwise they arrive as framing errors, read 0.
+ */
+static uint8_t sim_uart_line(uint8_t byte)
+{
+    sim_stats.uart_wire_ns += 10ULL * 1000000000 / sim_baudrate;
+
+    if (sim_uart_host_baud() != sim_baudrate ||
+        (sim_line_max_baud && sim_baudrate > sim_line_max_baud)) {
+        return 0;
+    }
+    return byte;
+}
+
+static int sim_uart_read(uint8_t *byte, int timeout_ms)
+{
+    struct pollfd pfd = { .fd = sim_uart_fd, .events = POLLIN };
+    ssize_t n;
+
+    if (poll(&pfd, 1, timeout_ms) <= 0) {
+        return -1;
+    }
+
+    n = read(sim_uart_fd, byte, 1);
+    if (n == 1) {
+        sim_stats.uart_bytes_rx++;
+        *byte = sim_uart_line(*byte);
+        return 0;
+    }
+
+    if (n == 0 || errno != EAGAIN) {
+        sim_fatal("uart: host side closed");
+    }
+    return -1;
+}
+
+/*
+ * The CPU doesn't read the UART while a flash write or erase stalls it. Of
+ * what the host sent meanwhile, the FIFO keeps 2 bytes and the rest is lost
+ * with OERR set. The pty delivers instantly, so only bytes already queued
+ * count as sent during the stall.
+ */
+void sim_uart_stall(unsigned long us)
+{
+    unsigned long wire_bytes = (unsigned long)(us * (unsigned long long)sim_baudrate / 10 / 1000000);
+    uint8_t byte;
+
+    if (!sim_uart_overrun || !RCSTA1bits.CREN || (rts_held && sim_uart_host_rtscts())) {
+        return;
+    }
+
+    while (wire_bytes-- && sim_uart_read(&byte, 0) == 0) {
+        if (rx_fifo_len < SIM_RX_FIFO_SIZE) {
+            rx_fifo[rx_fifo_len++] = byte;
+        } else {
+            RCSTA1bits.OERR = 1;
+            sim_stats.uart_bytes_lost++;
+        }
+    }
+}
+
+static int sim_uart_fifo_read(uint8_t *byte)
+{
+    if (!rx_fifo_len) {
+        /* what uart/uart.c does once the FIFO is empty */
+        RCSTA1bits.OERR = 0;
+        return -1;
+    }
+
+    *byte = rx_fifo[0];
+    rx_fifo[0] = rx_fifo[1];
+    rx_fifo_len--;
+    return 0;
+}
+
+void uart_unget_byte(uint8_t byte) {
+    if (rx_unget_len < SIM_RX_UNGET_SIZE) {
+        rx_unget[rx_unget_len++] = byte;
+    }
+}
+
+int uart_get_byte(uint8_t *byte, size_t timeout_us, bool block) {
+    uint64_t deadline;
+
+    if (rx_unget_len) {
+        *byte = rx_unget[--rx_unget_len];
+        return 0;
+    }
+
+    if (sim_uart_fifo_read(byte) == 0) {
+        return 0;
+    }
+
+    if (block) {
+        while (sim_uart_read(byte, -1));
+        return 0;
+    }
+
+    /* the hardware loop is tuned to ~1us per iteration, keep that timing */
+    deadline = sim_time_us() + timeout_us;
+    do {
+        if (sim_uart_read(byte, 0) == 0) {
+            return 0;
+        }
+    } while (sim_time_us() < deadline);
+
+    return -1;
+}
+
+int uart_expect_msg(char *msg, size_t _len, size_t timeout_us)
+{
+    char byte;
+    size_t i = 0, len = _len;
+    int ret;
+    /* Timer0 times it on the target */
+    uint64_t deadline = sim_time_us() + timeout_us;
+
+    while (len) {
+        ret = uart_get_byte((uint8_t *)&byte, 1, false);
+
+        if (sim_time_us() >= deadline) {
+            return -1;
+        }
+
+        if (ret == 0) {
+            if (byte == msg[i]) {
+                i++;
+                len--;
+            } else {
+                i = 0;
+                len = _len;
+            }
+        }
+    }
+    return 0;
+}
+
+void uart_write_byte(uint8_t byte) {
+    byte = sim_uart_line(byte);
+    while (write(sim_uart_fd, &byte, 1) != 1) {
+        if (errno != EAGAIN && errno != EINTR) {
+            sim_fatal("uart: write failed");
+        }
+    }
+    sim_stats.uart_bytes_tx++;
+}
+
+void uart_send_buf(uint8_t *buf, size_t cnt) {
+    while (cnt > 0) {
+        uart_write_byte(*buf);
+        buf++;
+        cnt--;
+    }
+}
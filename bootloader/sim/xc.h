@@ -0,0 +1,28 @@
+/*
+ * File:   xc.h
+ *
+ * Host stand-in for the XC8 <xc.h> header, used by the simulator build.
+ * It only provides what the bootloader headers and main.c touch directly,
+ * the hardware access itself lives in the sim/ HAL sources.
+ */
+
+#ifndef SIM_XC_H
+#define	SIM_XC_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef uint32_t uint24_t;
+
+struct sim_rcsta_bits {
+    unsigned CREN : 1;
+    unsigned OERR : 1;
+};
+
+extern volatile struct sim_rcsta_bits RCSTA1bits;
+
+/* inline assembly ("goto 4", "reset", "nop") is handled by the simulator */
+void sim_asm(const char *insn);
+#define asm(insn) sim_asm(insn)
+
+#endif	/* SIM_XC_H */
@@ -34,7 +34,7 @@
 #endif
 
 #ifndef uECC_WORD_SIZE
-    #if uECC_PLATFORM == uECC_avr
+    #if (uECC_PLATFORM == uECC_avr || uECC_PLATFORM == uECC_pic18)
         #define uECC_WORD_SIZE 1
     #elif (uECC_PLATFORM == uECC_x86_64 || uECC_PLATFORM == uECC_arm64)
         #define uECC_WORD_SIZE 8
@@ -53,6 +53,12 @@
     #define uECC_WORD_SIZE 1
 #endif
 
+#if ((uECC_PLATFORM == uECC_pic18) && (uECC_WORD_SIZE != 1))
+    #pragma message ("uECC_WORD_SIZE must be 1 for PIC18")
+    #undef uECC_WORD_SIZE
+    #define uECC_WORD_SIZE 1
+#endif
+
 #if ((uECC_PLATFORM == uECC_arm || uECC_PLATFORM == uECC_arm_thumb || \
         uECC_PLATFORM ==  uECC_arm_thumb2) && \
      (uECC_WORD_SIZE != 4))
@@ -3,6 +3,13 @@
 #include "uECC.h"
 #include "uECC_vli.h"
 
+#ifdef BTLD_PROBES
+#include "probes.h"
+#else
+#define PROBE_ENTER(id)
+#define PROBE_EXIT(id)
+#endif
+
 #ifndef uECC_RNG_MAX_TRIES
     #define uECC_RNG_MAX_TRIES 64
 #endif
@@ -186,6 +193,10 @@ static cmpresult_t uECC_vli_cmp_unsafe(const uECC_word_t *left,
     #include "asm_avr.inc"
 #endif
 
+#if (uECC_PLATFORM == uECC_pic18)
+    #include "asm_pic18.inc"
+#endif
+
 #if default_RNG_defined
 static uECC_RNG_Function g_rng_function = &default_RNG;
 #else
@@ -422,6 +433,8 @@ uECC_VLI_API void uECC_vli_mult(uECC_word_t *result,
     uECC_word_t r2 = 0;
     wordcount_t i, k;
 
+    PROBE_ENTER(PROBE_VLI_MULT);
+
     /* Compute each digit of result in sequence, maintaining the carries. */
     for (k = 0; k < num_words; ++k) {
         for (i = 0; i <= k; ++i) {
@@ -442,6 +455,8 @@ uECC_VLI_API void uECC_vli_mult(uECC_word_t *result,
         r2 = 0;
     }
     result[num_words * 2 - 1] = r0;
+
+    PROBE_EXIT(PROBE_VLI_MULT);
 }
 #endif /* !asm_mult */
 
@@ -504,6 +519,8 @@ uECC_VLI_API void uECC_vli_square(uECC_word_t *result,
 
     wordcount_t i, k;
 
+    PROBE_ENTER(PROBE_VLI_SQUARE);
+
     for (k = 0; k < num_words * 2 - 1; ++k) {
         uECC_word_t min = (k < num_words ? 0 : (k + 1) - num_words);
         for (i = min; i <= k && i <= k - i; ++i) {
@@ -520,6 +537,8 @@ uECC_VLI_API void uECC_vli_square(uECC_word_t *result,
     }
 
     result[num_words * 2 - 1] = r0;
+
+    PROBE_EXIT(PROBE_VLI_SQUARE);
 }
 #endif /* !asm_square */
 
@@ -705,6 +724,8 @@ uECC_VLI_API void uECC_vli_modInv(uECC_word_t *result,
         return;
     }
 
+    PROBE_ENTER(PROBE_VLI_MODINV);
+
     uECC_vli_set(a, input, num_words);
     uECC_vli_set(b, mod, num_words);
     uECC_vli_clear(u, num_words);
@@ -736,6 +757,8 @@ uECC_VLI_API void uECC_vli_modInv(uECC_word_t *result,
         }
     }
     uECC_vli_set(result, u, num_words);
+
+    PROBE_EXIT(PROBE_VLI_MODINV);
 }
 
 /* ------ Point operations ------ */
@@ -1136,6 +1159,100 @@ static bitcount_t smax(bitcount_t a, bitcount_t b) {
     return (a > b ? a : b);
 }
 
+#if (uECC_VERIFY_WINDOW < 1) || (uECC_VERIFY_WINDOW > 5)
+    #error "Unsupported value for uECC_VERIFY_WINDOW"
+#endif
+
+#if uECC_VERIFY_G_WINDOW
+    #if (uECC_VERIFY_G_WINDOW < 2) || (uECC_VERIFY_G_WINDOW > 7)
+        #error "Unsupported value for uECC_VERIFY_G_WINDOW"
+    #endif
+    #if !uECC_SUPPORTS_secp256k1 || uECC_SUPPORTS_secp160r1 || uECC_SUPPORTS_secp192r1 || \
+        uECC_SUPPORTS_secp224r1 || uECC_SUPPORTS_secp256r1
+        #error "uECC_VERIFY_G_WINDOW needs secp256k1 as the only supported curve"
+    #endif
+
+#include "g-table.inc"
+
+/* only the public key table is built at run time */
+#define uECC_VERIFY_RAM_TABLES 1
+#define uECC_VERIFY_U1_WINDOW uECC_VERIFY_G_WINDOW
+#else
+#define uECC_VERIFY_RAM_TABLES 2
+#define uECC_VERIFY_U1_WINDOW uECC_VERIFY_WINDOW
+#endif
+
+#if (uECC_VERIFY_WINDOW > 1) || uECC_VERIFY_G_WINDOW
+#define uECC_VERIFY_SLIDING 1
+#define uECC_VERIFY_TABLE_SIZE (1 << (uECC_VERIFY_WINDOW - 1))
+#else
+#define uECC_VERIFY_SLIDING 0
+#endif
+
+#if (uECC_VERIFY_WINDOW > 1)
+
+/* Fills table with P, 3P, 5P, ... in Jacobian coordinates, all sharing the Z
+   coordinate returned in Z. 'point' is affine. */
+static void verify_odd_multiples(uECC_word_t table[][uECC_MAX_WORDS * 2],
+                                 const uECC_word_t *point,
+                                 uECC_word_t *Z,
+                                 uECC_Curve curve) {
+    uECC_word_t dx[uECC_MAX_WORDS];
+    uECC_word_t dy[uECC_MAX_WORDS];
+    uECC_word_t t[uECC_MAX_WORDS];
+    wordcount_t num_words = curve->num_words;
+    uint8_t k, j;
+
+    uECC_vli_set(dx, point, num_words);
+    uECC_vli_set(dy, point + num_words, num_words);
+    uECC_vli_clear(Z, num_words);
+    Z[0] = 1;
+    curve->double_jacobian(dx, dy, Z, curve); /* D = 2P */
+
+    uECC_vli_set(table[0], point, num_words);
+    uECC_vli_set(table[0] + num_words, point + num_words, num_words);
+    apply_z(table[0], table[0] + num_words, Z, curve); /* P with the same Z as D */
+
+    for (k = 1; k < uECC_VERIFY_TABLE_SIZE; ++k) {
+        uECC_vli_set(table[k], table[k - 1], num_words * 2);
+        uECC_vli_modSub(t, table[k], dx, curve->p, num_words); /* Z factor = x2 - x1 */
+        XYcZ_add(dx, dy, table[k], table[k] + num_words, curve); /* (2k + 1)P */
+        uECC_vli_modMult_fast(Z, Z, t, curve);
+
+        /* bring the previous entries to the new Z */
+        for (j = 0; j < k; ++j) {
+            apply_z(table[j], table[j] + num_words, t, curve);
+        }
+    }
+}
+
+/* Converts the entries of the run time tables to affine coordinates with a single inversion. */
+static void verify_tables_to_affine(uECC_word_t table[][uECC_VERIFY_TABLE_SIZE][uECC_MAX_WORDS * 2],
+                                    uECC_word_t Z[][uECC_MAX_WORDS],
+                                    uECC_Curve curve) {
+    wordcount_t num_words = curve->num_words;
+    uint8_t s, k;
+#if (uECC_VERIFY_RAM_TABLES == 2)
+    uECC_word_t inv[uECC_MAX_WORDS];
+    uECC_word_t t[uECC_MAX_WORDS];
+
+    uECC_vli_modMult_fast(inv, Z[0], Z[1], curve);
+    uECC_vli_modInv(inv, inv, curve->p, num_words); /* 1 / (Z0 * Z1) */
+    uECC_vli_modMult_fast(t, inv, Z[1], curve);     /* 1 / Z0 */
+    uECC_vli_modMult_fast(Z[1], inv, Z[0], curve);  /* 1 / Z1 */
+    uECC_vli_set(Z[0], t, num_words);
+#else
+    uECC_vli_modInv(Z[0], Z[0], curve->p, num_words);
+#endif
+
+    for (s = 0; s < uECC_VERIFY_RAM_TABLES; ++s) {
+        for (k = 0; k < uECC_VERIFY_TABLE_SIZE; ++k) {
+            apply_z(table[s][k], table[s][k] + num_words, Z[s], curve);
+        }
+    }
+}
+#endif /* uECC_VERIFY_WINDOW > 1 */
+
 int uECC_verify(const uint8_t *public_key,
                 const uint8_t *message_hash,
                 unsigned hash_size,
@@ -1143,13 +1260,27 @@ int uECC_verify(const uint8_t *public_key,
                 uECC_Curve curve) {
     uECC_word_t u1[uECC_MAX_WORDS], u2[uECC_MAX_WORDS];
     uECC_word_t z[uECC_MAX_WORDS];
-    uECC_word_t sum[uECC_MAX_WORDS * 2];
     uECC_word_t rx[uECC_MAX_WORDS];
     uECC_word_t ry[uECC_MAX_WORDS];
     uECC_word_t tx[uECC_MAX_WORDS];
     uECC_word_t ty[uECC_MAX_WORDS];
     uECC_word_t tz[uECC_MAX_WORDS];
+#if uECC_VERIFY_SLIDING
+    /* odd multiples of Q, and of G unless they come from g-table.inc */
+    uECC_word_t table[uECC_VERIFY_RAM_TABLES][uECC_VERIFY_TABLE_SIZE][uECC_MAX_WORDS * 2];
+    uECC_word_t table_z[uECC_VERIFY_RAM_TABLES][uECC_MAX_WORDS];
+    const uECC_word_t *tables[2];
+    static const uint8_t widths[2] = {uECC_VERIFY_U1_WINDOW, uECC_VERIFY_WINDOW};
+    const uECC_word_t *scalars[2];
+    bitcount_t window_end[2];
+    uint8_t window[2];
+    uint8_t k;
+    bitcount_t j;
+    uECC_word_t empty;
+#else
+    uECC_word_t sum[uECC_MAX_WORDS * 2];
     const uECC_word_t *points[4];
+#endif
     const uECC_word_t *point;
     bitcount_t num_bits;
     bitcount_t i;
@@ -1195,6 +1326,88 @@ int uECC_verify(const uint8_t *public_key,
     uECC_vli_modMult(u1, u1, z, curve->n, num_n_words); /* u1 = e/s */
     uECC_vli_modMult(u2, r, z, curve->n, num_n_words); /* u2 = r/s */
 
+#if uECC_VERIFY_SLIDING
+    PROBE_ENTER(PROBE_VERIFY_TABLE);
+#if uECC_VERIFY_G_WINDOW
+    tables[0] = secp256k1_G_table[0];
+    tables[1] = table[0][0];
+#if (uECC_VERIFY_WINDOW > 1)
+    verify_odd_multiples(table[0], _public, table_z[0], curve);
+    verify_tables_to_affine(table, table_z, curve);
+#else
+    uECC_vli_set(table[0][0], _public, num_words * 2);
+#endif
+#else
+    tables[0] = table[0][0];
+    tables[1] = table[1][0];
+    verify_odd_multiples(table[0], curve->G, table_z[0], curve);
+    verify_odd_multiples(table[1], _public, table_z[1], curve);
+    verify_tables_to_affine(table, table_z, curve);
+#endif
+    PROBE_EXIT(PROBE_VERIFY_TABLE);
+
+    /* Sliding windows over u1 and u2, sharing the doublings. A window starts on
+       a set bit and ends on the lowest set bit within reach, so it selects an
+       odd multiple, which is added once the doublings reach its end. */
+    scalars[0] = u1;
+    scalars[1] = u2;
+    window_end[0] = window_end[1] = -1;
+    empty = 1;
+    num_bits = smax(uECC_vli_numBits(u1, num_n_words),
+                    uECC_vli_numBits(u2, num_n_words));
+
+    PROBE_ENTER(PROBE_VERIFY_LOOP);
+    for (i = num_bits - 1; i >= 0; --i) {
+        if (!empty) {
+            PROBE_ENTER(PROBE_POINT_DOUBLE);
+            curve->double_jacobian(rx, ry, z, curve);
+            PROBE_EXIT(PROBE_POINT_DOUBLE);
+        }
+
+        for (k = 0; k < 2; ++k) {
+            if (window_end[k] < 0 && uECC_vli_testBit(scalars[k], i)) {
+                j = (i >= widths[k] - 1 ? i - (widths[k] - 1) : 0);
+                while (!uECC_vli_testBit(scalars[k], j)) {
+                    ++j;
+                }
+                window_end[k] = j;
+                window[k] = 0;
+                for (j = i; j >= window_end[k]; --j) {
+                    window[k] = (uint8_t)((window[k] << 1) | !!uECC_vli_testBit(scalars[k], j));
+                }
+            }
+
+            if (window_end[k] != i) {
+                continue;
+            }
+            window_end[k] = -1;
+
+            point = tables[k] + (window[k] >> 1) * (uECC_MAX_WORDS * 2);
+            if (empty) {
+                uECC_vli_set(rx, point, num_words);
+                uECC_vli_set(ry, point + num_words, num_words);
+                uECC_vli_clear(z, num_words);
+                z[0] = 1;
+                empty = 0;
+                continue;
+            }
+
+            PROBE_ENTER(PROBE_POINT_ADD);
+            uECC_vli_set(tx, point, num_words);
+            uECC_vli_set(ty, point + num_words, num_words);
+            apply_z(tx, ty, z, curve);
+            uECC_vli_modSub(tz, rx, tx, curve->p, num_words); /* Z = x2 - x1 */
+            XYcZ_add(tx, ty, rx, ry, curve);
+            uECC_vli_modMult_fast(z, z, tz, curve);
+            PROBE_EXIT(PROBE_POINT_ADD);
+        }
+    }
+    PROBE_EXIT(PROBE_VERIFY_LOOP);
+
+    if (empty) {
+        return 0;
+    }
+#else
     /* Calculate sum = G + Q. */
     uECC_vli_set(sum, _public, num_words);
     uECC_vli_set(sum + num_words, _public + num_words, num_words);
@@ -1220,21 +1433,28 @@ int uECC_verify(const uint8_t *public_key,
     uECC_vli_clear(z, num_words);
     z[0] = 1;
 
+    PROBE_ENTER(PROBE_VERIFY_LOOP);
     for (i = num_bits - 2; i >= 0; --i) {
         uECC_word_t index;
+        PROBE_ENTER(PROBE_POINT_DOUBLE);
         curve->double_jacobian(rx, ry, z, curve);
+        PROBE_EXIT(PROBE_POINT_DOUBLE);
 
         index = (!!uECC_vli_testBit(u1, i)) | ((!!uECC_vli_testBit(u2, i)) << 1);
         point = points[index];
         if (point) {
+            PROBE_ENTER(PROBE_POINT_ADD);
             uECC_vli_set(tx, point, num_words);
             uECC_vli_set(ty, point + num_words, num_words);
             apply_z(tx, ty, z, curve);
             uECC_vli_modSub(tz, rx, tx, curve->p, num_words); /* Z = x2 - x1 */
             XYcZ_add(tx, ty, rx, ry, curve);
             uECC_vli_modMult_fast(z, z, tz, curve);
+            PROBE_EXIT(PROBE_POINT_ADD);
         }
     }
+    PROBE_EXIT(PROBE_VERIFY_LOOP);
+#endif /* uECC_VERIFY_SLIDING */
 
     uECC_vli_modInv(z, z, curve->p, num_words); /* Z = 1/Z */
     apply_z(rx, ry, z, curve);
@@ -16,6 +16,7 @@ Possible values for uECC_PLATFORM are defined below: */
 #define uECC_arm_thumb2 5
 #define uECC_arm64      6
 #define uECC_avr        7
+#define uECC_pic18      8 /* never guessed, select it explicitly for xc8 PIC18 builds */
 
 /* If desired, you can define uECC_WORD_SIZE as appropriate for your platform (1, 4, or 8 bytes).
 If uECC_WORD_SIZE is not explicitly defined then it will be automatically set based on your
@@ -37,6 +38,24 @@ faster somewhat faster, but increases the code size. */
     #define uECC_SQUARE_FUNC 0
 #endif
 
+/* uECC_VERIFY_WINDOW - Window width, in bits, used by uECC_verify() to compute u1*G + u2*Q.
+With 1, both scalars are processed one bit at a time (Shamir's trick with a 4 entry table).
+Larger values use sliding windows over tables of odd multiples of G and Q, which need
+2 * 2^(uECC_VERIFY_WINDOW - 1) points of RAM (64 bytes each for 256 bit curves), but save
+most of the point additions. Supported values are 1 - 5. */
+#ifndef uECC_VERIFY_WINDOW
+    #define uECC_VERIFY_WINDOW 1
+#endif
+
+/* uECC_VERIFY_G_WINDOW - If nonzero, uECC_verify() takes the odd multiples of the generator from
+a constant table generated by tools/gen-g-table.py (g-table.inc) instead of computing them, and
+uses this window width, 2 - 7, for u1. The table has 2^(uECC_VERIFY_G_WINDOW - 1) points and sits
+in program memory, so it costs no RAM. uECC_VERIFY_WINDOW then only applies to u2 and the public
+key. Only available when secp256k1 is the single supported curve. */
+#ifndef uECC_VERIFY_G_WINDOW
+    #define uECC_VERIFY_G_WINDOW 0
+#endif
+
 /* uECC_VLI_NATIVE_LITTLE_ENDIAN - If enabled (defined as nonzero), this will switch to native
 little-endian format for *all* arrays passed in and out of the public API. This includes public
 and private keys, shared secrets, signatures and message hashes.
@@ -2,27 +2,82 @@
 
 #define _XTAL_FREQ 64000000
 
+/* BRG16 = 1, BRGH = 1: baud rate = FOSC / (4 * (SPBRGH1:SPBRG1 + 1)) */
+static const uint16_t uart_brg[UART_BAUD_COUNT] = {
+    138, /* 115200, -0.08% */
+    34,  /* 460800, -0.8% */
+    15,  /* 1000000, exact */
+};
+
+/* 10 bits on the wire, rounded up */
+static const uint8_t uart_byte_us[UART_BAUD_COUNT] = { 87, 22, 10 };
+static uint8_t uart_baud;
+
+/*
+ * RTS output, low when the host may send. Wired to the CTS input of the
+ * USB-UART adapter, it stops the host while the bootloader can't read the
+ * UART, e.g. while a flash write stalls the CPU.
+ */
+#define UART_RTS LATCbits.LATC5
+#define UART_RTS_READY 0
+/* bytes the adapter may still send once RTS goes up */
+#define UART_RTS_SLACK 4
+
+/* bytes received while the host was being held */
+#define UART_RX_RING_SIZE 16
+static uint8_t rx_ring[UART_RX_RING_SIZE];
+static uint8_t rx_ring_head;
+static uint8_t rx_ring_len;
+/* the ring was full and bytes were dropped */
+static bool rx_ring_lost;
+
 void uart_init(enum rx_state rx_state) {
     TRISCbits.RC6 = 0; /* UART TX */
     TRISCbits.RC7 = 1; /* UART RX */
     ANSELCbits.ANSC7 = 0;
+    TRISCbits.RC5 = 0; /* RTS */
+    UART_RTS = UART_RTS_READY;
     TXSTA1bits.SYNC = 0;
     TXSTA1bits.TXEN = 1;
     RCSTA1bits.SPEN = 1;
     rx_state == RX_STATE_ENABLED ? uart_rx_enable() : uart_rx_disable();
 
-    SPBRG1 = 8 ; /* 115200 baudrate */
+    uart_set_baud(UART_BAUD_DEFAULT);
 }
 
-int uart_get_byte(uint8_t *byte, size_t timeout_us, bool block) {
+/* a byte being sent is finished by uart_write_byte(), nothing gets cut */
+void uart_set_baud(enum uart_baud baud) {
+    BAUDCON1bits.BRG16 = 1;
+    TXSTA1bits.BRGH = 1;
+    SPBRGH1 = (uint8_t)(uart_brg[baud] >> 8);
+    SPBRG1 = (uint8_t)uart_brg[baud];
+    uart_baud = baud;
+}
+
+/*
+ * A byte arriving with the 2 byte receive FIFO full, e.g. while the CPU is
+ * stalled by a flash write, sets OERR and stops the receiver until CREN is
+ * toggled. The lost bytes are recovered by the protocol.
+ */
+static void uart_clear_overrun(void) {
+    if (RCSTA1bits.OERR) {
+        RCSTA1bits.CREN = 0;
+        RCSTA1bits.CREN = 1;
+    }
+}
+
+static int uart_read(uint8_t *byte, size_t timeout_us, bool block) {
     int ret = -1;
 
     if (block) {
-        while(!PIR1bits.RC1IF);
+        while(!PIR1bits.RC1IF) {
+            uart_clear_overrun();
+        }
         *byte = RCREG1;
         return 0;
     }
 
+    uart_clear_overrun();
     for (; timeout_us > 0; timeout_us--) {
         if (PIR1bits.RC1IF == 0) {
             // loop tunning for delaying exactly 1us necessary
@@ -37,17 +92,90 @@ int uart_get_byte(uint8_t *byte, size_t timeout_us, bool block) {
     return ret;
 }
 
+int uart_get_byte(uint8_t *byte, size_t timeout_us, bool block) {
+    if (rx_ring_len) {
+        *byte = rx_ring[rx_ring_head];
+        rx_ring_head = (rx_ring_head + 1) % UART_RX_RING_SIZE;
+        rx_ring_len--;
+        return 0;
+    }
+
+    return uart_read(byte, timeout_us, block);
+}
+
+/* puts a byte back in front of the received ones, for the next read */
+void uart_unget_byte(uint8_t byte) {
+    if (rx_ring_len < UART_RX_RING_SIZE) {
+        rx_ring_head = (rx_ring_head + UART_RX_RING_SIZE - 1) % UART_RX_RING_SIZE;
+        rx_ring[rx_ring_head] = byte;
+        rx_ring_len++;
+    }
+}
+
+/*
+ * Stops the host before the bootloader gets busy without reading the UART.
+ * The adapter finishes what it already started sending, that goes to the
+ * ring buffer until the line is quiet. Bytes that don't fit are dropped,
+ * e.g. from a host without flow control, and uart_rx_lost() tells.
+ */
+void uart_rx_hold(void) {
+    uint8_t byte;
+
+    UART_RTS = !UART_RTS_READY;
+
+    while (uart_read(&byte, (size_t)uart_byte_us[uart_baud] * UART_RTS_SLACK, false) == 0) {
+        if (rx_ring_len < UART_RX_RING_SIZE) {
+            rx_ring[(rx_ring_head + rx_ring_len) % UART_RX_RING_SIZE] = byte;
+            rx_ring_len++;
+        } else {
+            rx_ring_lost = true;
+        }
+    }
+}
+
+bool uart_rx_lost(void) {
+    bool lost = rx_ring_lost;
+
+    rx_ring_lost = false;
+    return lost;
+}
+
+void uart_rx_release(void) {
+    UART_RTS = UART_RTS_READY;
+}
+
+/*
+ * Timer0 times uart_expect_msg(), a pass of its loop takes a few us more
+ * than the 1us uart_read() waits. 16 bit, FOSC/4 with a 1:256 prescaler:
+ * 16us ticks, up to about 1s.
+ */
+#define UART_TIMER_TICK_US 16
+
+static void uart_timer_start(void) {
+    T0CON = 0x07; /* stopped, 16 bit, FOSC/4, 1:256 prescaler */
+    TMR0H = 0; /* written to the timer along with TMR0L */
+    TMR0L = 0;
+    T0CONbits.TMR0ON = 1;
+}
+
+static uint32_t uart_timer_us(void) {
+    uint8_t lo = TMR0L; /* latches TMR0H */
+
+    return ((uint32_t)TMR0H << 8 | lo) * UART_TIMER_TICK_US;
+}
+
 int uart_expect_msg(char *msg, size_t _len, size_t timeout_us)
 {
     char byte;
     size_t i = 0, len = _len;
     int ret;
 
+    uart_timer_start();
     while (len) {
         ret = uart_get_byte((uint8_t *)&byte, 1, false);
 
-        timeout_us--;
-        if (!timeout_us) {
+        if (uart_timer_us() >= timeout_us) {
+            T0CONbits.TMR0ON = 0;
             return -1;
         }
 
@@ -61,6 +189,7 @@ int uart_expect_msg(char *msg, size_t _len, size_t timeout_us)
             }
         }
     }
+    T0CONbits.TMR0ON = 0;
     return 0;
 }
 
@@ -7,8 +7,24 @@ enum rx_state {
     RX_STATE_ENABLED,
 };
 
+/* speeds for uart_set_baud(), the host asks for one by its index */
+enum uart_baud {
+    UART_BAUD_115200,
+    UART_BAUD_460800,
+    UART_BAUD_1000000,
+    UART_BAUD_COUNT,
+};
+
+#define UART_BAUD_DEFAULT UART_BAUD_115200
+
 void uart_init(enum rx_state rx_state);
+void uart_set_baud(enum uart_baud baud);
+void uart_rx_hold(void);
+void uart_rx_release(void);
+/* true once after received bytes were dropped while holding the host */
+bool uart_rx_lost(void);
 int uart_get_byte(uint8_t *byte, size_t timeout_us, bool block);
+void uart_unget_byte(uint8_t byte);
 void uart_write_byte(uint8_t byte);
 int uart_expect_msg(char *msg, size_t len, size_t timeout_us);
 void uart_send_buf(uint8_t *buf, size_t cnt);
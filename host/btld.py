@@ -1,8 +1,10 @@
+import argparse
+import binascii
 import serial
 import sys
-import math
 import hashlib
 import time
+import zlib
 import ecdsa
 from ecdsa import SigningKey
 from ecdsa.util import sigencode_string
@@ -15,15 +17,74 @@ HOST_MSG_PROGRAM_SIZE = b'M'
 HOST_MSG_PROGRAM_SIGNAT = b'N'
 HOST_MSG_FLASH_DATA = b'D'
 HOST_MSG_FLASH_STOP = b'X'
+HOST_MSG_ERASE = b'E'
+HOST_MSG_ROW_CRC = b'C'
+HOST_MSG_ROWS_HASH = b'H'
+HOST_MSG_FLASH_PACKED = b'Z'
 
 MCU_MSG_OP_SUCCESS = b'F'
+MCU_MSG_RESEND = b'R'
+MCU_MSG_SIG_CHECK_OK = b'S'
+MCU_MSG_SIG_CHECK_FAIL = b'K'
 
 MCU_ERR_INVALID_PAYLOAD = b'I'
 MCU_ERR_DENIED_ADDR = b'A'
+# a flash row read back different after programming, the row number follows
+MCU_ERR_VERIFY = b'V'
+
+# the signature check at the end of flashing takes a few seconds on the MCU
+MCU_SIG_CHECK_TIMEOUT = 60
+
+# messages sent ahead of the last acknowledged one
+HOST_WINDOW = 1
+# with RTS/CTS the MCU holds the host while it can't read the UART, so
+# bytes sent ahead don't get lost anymore
+HOST_WINDOW_RTSCTS = 8
+# acks missed in a row before giving up, each one makes the window be sent again
+MCU_ACK_RETRIES = 10
+# times the rows the MCU failed to program are sent again
+MCU_VERIFY_RETRIES = 3
+# ack timeout for erasing the whole application and for row CRCs
+MCU_LONG_OP_TIMEOUT = 5
+# rows asked for in one row CRC message
+ROW_CRC_QUERY_ROWS = 32
+# SHA256 bytes the MCU sends back for a range of rows
+ROWS_HASH_SIZE = 16
+
+# LZSS parameters, as in bootloader/lz/lz.h
+LZ_MIN_MATCH = 3
+LZ_MAX_MATCH = LZ_MIN_MATCH + 15
+LZ_WINDOW = 4096
+# the MCU relocates the user code GOTO, flash below this isn't as in the image
+LZ_DICT_START = 8
+# candidates tried for each position, the most recent first
+LZ_CHAIN = 64
+
+# MCU flash row, programmed in one go
+FLASH_BLOCK_SIZ = 64
 
 HOST_HANDSHAKE_MSG = b'@BTL\n'
 MCU_HANDSHAKE_RESP = b'@OK\n'
 
+# UART speeds the MCU can switch to after the handshake, by index
+MCU_BAUDS = [115200, 460800, 1000000]
+MCU_BAUD_DEFAULT = MCU_BAUDS[0]
+# session setup requests: @, option, value digit, \n, echoed back
+HOST_SETUP_SPEED = b'S'
+HOST_SETUP_FRAMING = b'F'
+# the MCU goes back to the default speed when the handshake doesn't come
+# through at the new one in this time, then waits longer for a new request
+MCU_BAUD_CHECK_TIMEOUT = 0.06
+MCU_SETUP_RETRY_TIMEOUT = 3 * 0.06
+
+# message framings, by index: @ ... \n with escapes, or COBS ended by 0
+FRAMINGS = ['escaped', 'cobs']
+HOST_MSG_COBS_END = 0
+# the one agreed on in the session setup
+uart_framing = 'escaped'
+# rows the MCU reported it failed to program, to be sent again
+bad_rows = set()
+
 def ascii2dec(x):
     if ord(x) >= ord("0") and ord(x) <= ord("9"):
         return ord(x) - 48
@@ -46,6 +107,34 @@ def encode_for_uart(data):
     return encoded
 
 
+def encode_cobs(data):
+    # every code byte holds the distance to the next 0 byte, or 0xFF for
+    # 254 bytes without one, so 0 only ends the message
+    encoded = [0]
+    code_at = 0
+    for d in data:
+        if d:
+            encoded.append(d)
+        if not d or len(encoded) - code_at == 0xff:
+            encoded[code_at] = len(encoded) - code_at
+            code_at = len(encoded)
+            encoded.append(0)
+    encoded[code_at] = len(encoded) - code_at
+    encoded.append(HOST_MSG_COBS_END)
+    return encoded
+
+
+def encode_msg(msg, seq):
+    # operation, sequence number, payload length, payload and CRC16 of them all
+    framed = [msg[0], seq & 0xff, len(msg) - 1] + msg[1:]
+    crc = binascii.crc_hqx(bytes(framed), 0xffff)
+    framed.append((crc >> 8) & 0xff)
+    framed.append(crc & 0xff)
+    if uart_framing == 'cobs':
+        return encode_cobs(framed)
+    return encode_for_uart(framed)
+
+
 def encode_data(data, count, addr):
     encoded = []
     addr_up = (addr >> 16) & 0xff
@@ -61,7 +150,81 @@ def encode_data(data, count, addr):
     for d in data:
         encoded.append(d)
 
-    return encode_for_uart(encoded)
+    return encoded
+
+
+def encode_packed(packed, addr):
+    encoded = [ord(HOST_MSG_FLASH_PACKED), (addr >> 16) & 0xff, (addr >> 8) & 0xff, addr & 0xff]
+    return encoded + list(packed)
+
+
+def lz_index(lz, image, end):
+    # adds the image positions whose 3 bytes all lie below end
+    for p in range(lz['upto'], end - 2):
+        lz['index'].setdefault(bytes(image[p:p + 3]), []).append(p)
+    lz['upto'] = max(lz['upto'], end - 2)
+
+
+def lz_pack(lz, image, addr, data):
+    # LZSS of data, to be written at addr. Rows below are final in flash by
+    # the time the MCU unpacks it, so back-references can point there, or
+    # to data itself, but not to the start of its own row, not erased yet.
+    row_start = addr - addr % FLASH_BLOCK_SIZ
+    lz_index(lz, image, row_start)
+    local = {}
+    items = []
+
+    def byte_at(a):
+        if a >= addr:
+            return data[a - addr]
+        if a < row_start:
+            return image[a]
+        return None
+
+    p = 0
+    while p < len(data):
+        best_len = 0
+        best_src = 0
+
+        if p + LZ_MIN_MATCH <= len(data):
+            key = bytes(data[p:p + LZ_MIN_MATCH])
+            cands = lz['index'].get(key, [])[-LZ_CHAIN:] + local.get(key, [])
+            for src in reversed(cands):
+                if addr + p - src > LZ_WINDOW:
+                    break
+                n = 0
+                while n < LZ_MAX_MATCH and p + n < len(data) and byte_at(src + n) == data[p + n]:
+                    n += 1
+                if n > best_len:
+                    best_len = n
+                    best_src = src
+
+        step = best_len if best_len >= LZ_MIN_MATCH else 1
+        if step > 1:
+            items.append((addr + p - best_src, best_len))
+        else:
+            items.append(data[p])
+
+        for q in range(p, p + step):
+            if q + LZ_MIN_MATCH <= len(data):
+                local.setdefault(bytes(data[q:q + LZ_MIN_MATCH]), []).append(addr + q)
+        p += step
+
+    packed = bytearray()
+    for i in range(0, len(items), 8):
+        flags = 0
+        body = bytearray()
+        for bit, item in enumerate(items[i:i + 8]):
+            if isinstance(item, int):
+                flags |= 1 << bit
+                body.append(item)
+            else:
+                dist, n = item
+                body += (((dist - 1) << 4) | (n - LZ_MIN_MATCH)).to_bytes(2, 'big')
+        packed.append(flags)
+        packed += body
+
+    return packed
 
 
 def encode_size(fw_size):
@@ -75,7 +238,7 @@ def encode_size(fw_size):
     encoded.append(hi)
     encoded.append(lo)
 
-    return encode_for_uart(encoded)
+    return encoded
 
 
 def encode_signat(signat):
@@ -86,32 +249,366 @@ def encode_signat(signat):
     for s in signat:
         encoded.append(s)
 
-    return encode_for_uart(encoded)
+    return encoded
+
+
+def encode_erase(first_row=None, row_cnt=None):
+    # no payload erases the application rows not erased yet
+    encoded = [ord(HOST_MSG_ERASE)]
+
+    if first_row is not None:
+        encoded += [(first_row >> 8) & 0xff, first_row & 0xff, (row_cnt >> 8) & 0xff, row_cnt & 0xff]
+
+    return encoded
+
 
+def encode_row_crc(first_row, row_cnt):
+    return [ord(HOST_MSG_ROW_CRC), (first_row >> 8) & 0xff, first_row & 0xff, row_cnt]
 
-def wait_for_mcu(ser):
-    print("Waiting for MCU")
+
+def encode_rows_hash(first_row, row_cnt):
+    return [ord(HOST_MSG_ROWS_HASH), (first_row >> 8) & 0xff, first_row & 0xff, (row_cnt >> 8) & 0xff, row_cnt & 0xff]
+
+
+def read_bad_row(ser):
+    # the row number after a V, the ack of the message follows
+    row = ser.read(2)
+    if len(row) == 2:
+        print("MCU failed to program row", row[0] << 8 | row[1])
+        bad_rows.add(row[0] << 8 | row[1])
+
+
+def wait_for_ack(ser):
+    # returns the MCU reply and its sequence number, None on timeout
     while True:
         resp = ser.read(1)
 
-        if resp == MCU_MSG_OP_SUCCESS:
-            return
+        if resp == MCU_MSG_OP_SUCCESS or resp == MCU_MSG_RESEND:
+            seq = ser.read(1)
+            return (resp, seq[0]) if seq else None
+        elif resp == MCU_ERR_VERIFY:
+            read_bad_row(ser)
         elif resp == MCU_ERR_INVALID_PAYLOAD:
             print("ERR: MCU reported invalid payload")
             sys.exit(-1)
         elif resp == MCU_ERR_DENIED_ADDR:
             print("ERR: MCU reported denied write address")
             sys.exit(-1)
+        elif not resp:
+            return None
+
+
+def encode_row(image, row, lz=None):
+    # Data message for a flash row, gaps inside are 0xFF. The row is erased
+    # before being written, so 0xFF bytes at its ends are left out, and for
+    # a row with nothing else there's no message. With lz, the rows must be
+    # encoded in increasing order and the data is packed when that's shorter.
+    addr = row * FLASH_BLOCK_SIZ
+    data = image[addr:addr + FLASH_BLOCK_SIZ]
+    first = 0
+    end = len(data)
+
+    while end > first and data[end - 1] == 0xFF:
+        end -= 1
+    if addr == 0:
+        # the MCU relocates the user code GOTO in bytes 0-3 and skips 4-7
+        end = max(end, 8) if end else 0
+    else:
+        while first < end and data[first] == 0xFF:
+            first += 1
+
+    if first == end:
+        print("Row addr", addr, "erased")
+        return None
+
+    if lz is not None:
+        packed = lz_pack(lz, image, addr + first, data[first:end])
+        if len(packed) + 3 < end - first + 4:
+            print("Row addr", addr + first, "count", end - first, "packed", len(packed))
+            return encode_packed(packed, addr + first)
+
+    print("Row addr", addr + first, "count", end - first)
+    return encode_data(list(data[first:end]), end - first, addr + first)
+
+
+def row_view(image, row):
+    # a row of the image the way the MCU computes its CRC: 0xFF past the end
+    # of the image, and in row 0 the user code GOTO first, then 4 bytes 0xFF
+    data = bytearray(image[row * FLASH_BLOCK_SIZ:(row + 1) * FLASH_BLOCK_SIZ])
+    data += b'\xff' * (FLASH_BLOCK_SIZ - len(data))
+    if row == 0:
+        data[4:8] = b'\xff' * 4
+    return data
+
+
+def send_msgs(ser, msgs, window, seq=0, timeout=None):
+    # Go-back-N: keep up to window messages in flight, the MCU acks the last
+    # one it handled and drops anything after a lost one, so on a missing
+    # ack or a resend request everything from the oldest unacked message is
+    # sent again. Returns the sequence number of the next message.
+    base = 0
+    next_msg = 0
+    retries = 0
+    ser_timeout = ser.timeout
+
+    if timeout:
+        ser.timeout = timeout
+
+    while base < len(msgs):
+        while next_msg < len(msgs) and next_msg - base < window:
+            ser.write(bytes(encode_msg(msgs[next_msg], seq + next_msg)))
+            next_msg += 1
+
+        reply = wait_for_ack(ser)
+        if reply is None:
+            retries += 1
+            if retries > MCU_ACK_RETRIES:
+                print("ERR: MCU stopped answering")
+                sys.exit(-1)
+            print("No ack from MCU, sending again from message", base)
+            next_msg = base
+            continue
+
+        resp, ack_seq = reply
+        if resp == MCU_MSG_RESEND:
+            # ack_seq is the message the MCU expects, the ones before got handled
+            acked = (ack_seq - seq - base) & 0xff
+            if acked <= next_msg - base:
+                base += acked
+                retries += 1
+                if retries > MCU_ACK_RETRIES:
+                    print("ERR: MCU keeps receiving damaged messages")
+                    sys.exit(-1)
+                print("MCU asked to send again from message", base)
+                next_msg = base
+            continue
+
+        acked = ((ack_seq - seq - base) & 0xff) + 1
+        if acked <= next_msg - base:
+            base += acked
+            retries = 0
+
+    ser.timeout = ser_timeout
+    return seq + len(msgs)
+
+
+def query_row_crcs(ser, seq):
+    # CRC32 of every row below the bootloader, as the MCU holds them now
+    crcs = []
+
+    while True:
+        seq = send_msgs(ser, [encode_row_crc(len(crcs), ROW_CRC_QUERY_ROWS)], 1, seq, MCU_LONG_OP_TIMEOUT)
+
+        ser.timeout, ser_timeout = MCU_LONG_OP_TIMEOUT, ser.timeout
+        count = ser.read(1)
+        reply = ser.read(count[0] * 4) if count else b''
+        ser.timeout = ser_timeout
+
+        if not count or len(reply) != count[0] * 4:
+            print("ERR: MCU row CRC reply cut short")
+            sys.exit(-1)
+
+        for i in range(0, len(reply), 4):
+            crcs.append(int.from_bytes(reply[i:i + 4], 'big'))
+
+        if count[0] < ROW_CRC_QUERY_ROWS:
+            return crcs, seq
+
+
+def query_rows_hash(ser, seq, first_row, row_cnt):
+    # rows hashed by the MCU and the start of their SHA256, hashing the
+    # whole flash takes about as long as the signature check
+    seq = send_msgs(ser, [encode_rows_hash(first_row, row_cnt)], 1, seq, MCU_SIG_CHECK_TIMEOUT)
+
+    ser.timeout, ser_timeout = MCU_SIG_CHECK_TIMEOUT, ser.timeout
+    reply = ser.read(2 + ROWS_HASH_SIZE)
+    ser.timeout = ser_timeout
+
+    if len(reply) != 2 + ROWS_HASH_SIZE:
+        print("ERR: MCU rows hash reply cut short")
+        sys.exit(-1)
+
+    return int.from_bytes(reply[:2], 'big'), reply[2:], seq
+
+
+def setup_request(ser, option, value):
+    # returns the value the MCU took, 0 when it doesn't support the one asked
+    req = HOST_MSG_START + option + bytes([ord('0') + value]) + HOST_MSG_END
+    ser.write(req)
+    resp = ser.read(len(req))
+    if len(resp) != len(req) or resp[:2] != req[:2] or resp[3:] != HOST_MSG_END:
+        print("ERR: unexpected reply to the session setup request:", resp)
+        sys.exit(-1)
+    return resp[2] - ord('0')
+
+
+def baud_try(ser, baud):
+    # asks the MCU for a speed and repeats the handshake at it, on failure
+    # both ends are back at the default speed
+    value = MCU_BAUDS.index(baud)
+    if setup_request(ser, HOST_SETUP_SPEED, value) != value:
+        return False
+
+    if baud == MCU_BAUD_DEFAULT:
+        return True
+
+    ser.baudrate = baud
+    ser.write(HOST_HANDSHAKE_MSG)
+    timeout = ser.timeout
+    ser.timeout = MCU_BAUD_CHECK_TIMEOUT
+    resp = ser.read(len(MCU_HANDSHAKE_RESP))
+    ser.timeout = timeout
+
+    if resp == MCU_HANDSHAKE_RESP:
+        return True
+
+    print("No handshake at", baud, "baud")
+    ser.baudrate = MCU_BAUD_DEFAULT
+    # the MCU is back at the default speed once its own timeout is over, a
+    # read timeout ago at the latest, and waits MCU_SETUP_RETRY_TIMEOUT for
+    # the next request, so there is slack for latency on both sides
+    time.sleep(MCU_BAUD_CHECK_TIMEOUT)
+    ser.reset_input_buffer()
+    return False
+
+
+def baud_negotiate(ser, baud):
+    # the fastest speed up to baud that gets through
+    for b in reversed(MCU_BAUDS[:MCU_BAUDS.index(baud) + 1]):
+        if baud_try(ser, b):
+            print("UART at", b, "baud")
+            return
+    print("UART at", MCU_BAUD_DEFAULT, "baud")
+
+
+def framing_negotiate(ser, framing):
+    # ends the session setup
+    global uart_framing
+    uart_framing = FRAMINGS[setup_request(ser, HOST_SETUP_FRAMING, FRAMINGS.index(framing))]
+    print("Messages framed", uart_framing)
+
+
+def check_image(ser, image):
+    # compares the flash with the image without changing it, then lets the
+    # MCU check the signature of what it holds
+    row_cnt = (len(image) + FLASH_BLOCK_SIZ - 1) // FLASH_BLOCK_SIZ
+    hashed, mcu_hash, seq = query_rows_hash(ser, 0, 0, row_cnt)
+
+    fw_hash = hashlib.sha256(b''.join(row_view(image, r) for r in range(hashed)))
+    same = hashed == row_cnt and fw_hash.digest()[:ROWS_HASH_SIZE] == mcu_hash
+    print("MCU flash", "matches" if same else "differs from", "the hex file,", hashed, "rows compared")
+
+    ser.write(bytes(encode_msg([ord(HOST_MSG_FLASH_STOP)], seq)))
+    wait_for_sig_check(ser)
+
+    return 0 if same else -1
+
+
+def delta_rows(image, rows, crcs):
+    # rows to send again: the ones that changed and the ones past what the
+    # MCU reports, for it to deny
+    changed = set(r for r in range(len(crcs)) if zlib.crc32(row_view(image, r)) != crcs[r])
+    changed |= set(r for r in rows if r >= len(crcs))
+
+    if 0 in changed:
+        # the MCU erases row 1 together with row 0
+        changed.add(1)
+
+    return changed
+
+
+def wait_for_sig_check(ser):
+    # False when the MCU failed to program the last row instead, the
+    # session goes on then
+    print("Waiting for MCU signature check")
+    deadline = time.time() + MCU_SIG_CHECK_TIMEOUT
+    while time.time() < deadline:
+        resp = ser.read(1)
+
+        if resp == MCU_MSG_SIG_CHECK_OK:
+            print("MCU reported valid signature")
+            return True
+        elif resp == MCU_MSG_SIG_CHECK_FAIL:
+            print("ERR: MCU reported invalid signature, image rejected")
+            sys.exit(-1)
+        elif resp == MCU_ERR_VERIFY:
+            read_bad_row(ser)
+            # the ack of the stop message
+            ser.read(2)
+            return False
+
+    # bootloaders without hash-while-receiving don't answer
+    print("No signature check result from MCU")
+    return True
+
+
+def resend_bad_rows(ser, image, metadata, window, seq):
+    # The MCU erases the rows it failed to program again once they're sent
+    # again, row 1 along with row 0. The image size and signature are in the
+    # rows past the image, a bad row there means sending them again too.
+    for attempt in range(MCU_VERIFY_RETRIES):
+        if not bad_rows:
+            return seq
+
+        rows = set(bad_rows)
+        bad_rows.clear()
+        if 0 in rows:
+            rows.add(1)
+        print("Sending rows", sorted(rows), "again")
+
+        msgs = []
+        for row in sorted(rows):
+            msg = encode_row(image, row)
+            msgs.append(msg if msg else encode_erase(row, 1))
+        if max(rows) >= (len(image) - 1) // FLASH_BLOCK_SIZ:
+            msgs += metadata
+        seq = send_msgs(ser, msgs, window, seq)
+
+    if bad_rows:
+        print("ERR: MCU keeps failing to program rows", sorted(bad_rows))
+        sys.exit(-1)
+    return seq
 
 
 def main():
-    ser = serial.Serial(sys.argv[1], baudrate=115200, timeout=0.5)
-    f = open(sys.argv[2], 'r', encoding="utf-8")
-    fw_hash = hashlib.new('sha256')
+    parser = argparse.ArgumentParser()
+    parser.add_argument('port')
+    parser.add_argument('hex_file')
+    parser.add_argument('key_file', nargs='?')
+    parser.add_argument('-w', '--window', type=int,
+                        help="messages sent ahead of the MCU acks (1-255, default %d, %d with --rtscts)"
+                        % (HOST_WINDOW, HOST_WINDOW_RTSCTS))
+    parser.add_argument('-r', '--rtscts', action='store_true',
+                        help="the MCU RTS output is wired to the adapter CTS input")
+    parser.add_argument('-d', '--delta', action='store_true',
+                        help="only erase and write the flash rows that changed")
+    parser.add_argument('-z', '--compress', action='store_true',
+                        help="send the rows LZSS packed when that's shorter")
+    parser.add_argument('-b', '--baud', type=int, default=MCU_BAUDS[-1], choices=MCU_BAUDS,
+                        help="UART speed after the handshake (default %d)" % MCU_BAUDS[-1])
+    parser.add_argument('-f', '--framing', default=FRAMINGS[-1], choices=FRAMINGS,
+                        help="message framing after the handshake (default %s)" % FRAMINGS[-1])
+    parser.add_argument('-c', '--check', action='store_true',
+                        help="compare the MCU flash with the hex file instead of flashing it")
+    args = parser.parse_args()
+
+    if args.window is None:
+        args.window = HOST_WINDOW_RTSCTS if args.rtscts else HOST_WINDOW
+    if args.window < 1 or args.window > 255:
+        print("window must be between 1 and 255")
+        return -1
+
+    if not args.check and not args.key_file:
+        print("a private key is needed for flashing")
+        return -1
+
+    ser = serial.Serial(args.port, baudrate=MCU_BAUD_DEFAULT, timeout=0.5, rtscts=args.rtscts)
+    f = open(args.hex_file, 'r', encoding="utf-8")
+    # flashed image from address 0, 0xFF where the hex file has no data
+    image = bytearray()
+    rows = set()
 
-    next_expect_addr = 0
     ignore_next_data_rec = False
-    fw_size = 0
     addr_upper = 0
 
     while (True):
@@ -127,6 +624,9 @@ def main():
             print("Received unexepcted:", mcu_resp)
     print("MCU ready")
 
+    baud_negotiate(ser, args.baud)
+    framing_negotiate(ser, args.framing)
+
     for line in f:
         if line[0] != ':':
             print("Unexpected start of hex file")
@@ -148,60 +648,81 @@ def main():
                 print("Ignoring this record")
                 continue
 
-            fw_size += count
-
-            if next_expect_addr < addr:
-                fill_data = []
-                fill_cnt = addr - next_expect_addr
-                fw_size += fill_cnt
-
-                print("Fill with", fill_cnt, "0xFF")
-                for i in range(64):
-                    fill_data.append(0xFF)
-
-                for i in range(math.floor(fill_cnt / 64)):
-                    fw_hash.update(bytes(fill_data))
+            if len(image) < addr + count:
+                image.extend(b'\xff' * (addr + count - len(image)))
 
-                if fill_cnt % 64:
-                    fw_hash.update(bytes(fill_data[:fill_cnt % 64]))
-
-            data = []
             for i in range(count):
-                data.append(ascii2dec(line[9 + i * 2]) * 16 + ascii2dec(line[10 + i * 2]))
-
-            fw_hash.update(bytes(data))
-            print("data is", data)
-            encoded = encode_data(data, count, addr)
-            print("encoded is", encoded)
+                image[addr + i] = ascii2dec(line[9 + i * 2]) * 16 + ascii2dec(line[10 + i * 2])
 
-            ser.write(bytes(encoded))
-            next_expect_addr = addr + count
-            wait_for_mcu(ser)
+            print("data is", list(image[addr:addr + count]))
+            if count:
+                rows.update(range(addr // FLASH_BLOCK_SIZ, (addr + count - 1) // FLASH_BLOCK_SIZ + 1))
 
         elif rec_type == 1:
-            # hex done
-            print("Sending size", fw_size)
-            enc_siz = encode_size(fw_size)
-            ser.write(bytes(enc_siz))
-            wait_for_mcu(ser)
-
+            # hex done, the image is signed up to its last data byte
+            if args.check:
+                return check_image(ser, image)
+
+            fw_size = len(image)
+            seq = 0
+            lz = {'index': {}, 'upto': LZ_DICT_START} if args.compress else None
+
+            if args.delta:
+                crcs, seq = query_row_crcs(ser, seq)
+                changed = delta_rows(image, rows, crcs)
+                print("Delta update,", len(changed), "of", len(crcs), "rows changed")
+
+                msgs = []
+                for row in sorted(changed):
+                    msg = encode_row(image, row, lz)
+                    msgs.append(msg if msg else encode_erase(row, 1))
+            else:
+                # the MCU erases a row when first written to, the blank rows
+                # in between are erased in the same order, so it keeps
+                # hashing the image as it comes
+                msgs = []
+                blank_from = None
+                for row in range(max(rows) + 1 if rows else 0):
+                    msg = encode_row(image, row, lz)
+                    if not msg:
+                        blank_from = row if blank_from is None else blank_from
+                        continue
+                    if blank_from is not None:
+                        msgs.append(encode_erase(blank_from, row - blank_from))
+                        blank_from = None
+                    msgs.append(msg)
+
+            fw_hash = hashlib.sha256(image)
             print("fw sha256:", fw_hash.hexdigest())
 
-            with open(sys.argv[3]) as f:
+            with open(args.key_file) as f:
                sk = SigningKey.from_pem(f.read(), hashlib.sha256)
 
             # sign hash and write signature
             fw_sig = sk.sign_digest_deterministic(fw_hash.digest(), sigencode=sigencode_string)
 
-            print("signat is:", fw_sig.hex())
+            print("Sending", len(msgs), "messages, window", args.window)
+            seq = send_msgs(ser, msgs, args.window, seq)
 
-            ser.write(bytes(encode_signat(fw_sig)))
-            wait_for_mcu(ser)
+            if not args.delta:
+                print("Erasing the rest of the application")
+                seq = send_msgs(ser, [encode_erase()], 1, seq, MCU_LONG_OP_TIMEOUT)
 
-            ser.write(HOST_MSG_START + HOST_MSG_FLASH_STOP +  HOST_MSG_END)
+            print("signat is:", fw_sig.hex())
+            # the size after the signature, which ends in the same flash
+            # row, so the MCU programs that row once
+            print("Sending size", fw_size)
+            metadata = [encode_signat(fw_sig), encode_size(fw_size)]
+            seq = send_msgs(ser, metadata, args.window, seq)
 
-            print("Flashing done")
-            return
+            while True:
+                seq = resend_bad_rows(ser, image, metadata, args.window, seq)
+                ser.write(bytes(encode_msg([ord(HOST_MSG_FLASH_STOP)], seq)))
+                seq += 1
+
+                print("Flashing done")
+                if wait_for_sig_check(ser):
+                    return
 
         elif rec_type == 4:
             ignore_next_data_rec = False
@@ -0,0 +1,92 @@
+import subprocess
+import sys
+
+# Builds the bootloader for each uECC configuration and reports the signature
+# check cost, measured by the host benchmark, next to the xc8 code size for
+# each compiler optimization level. Run from the bootloader directory, through
+# "make matrix". Other make variables given to "make matrix" apply to all builds.
+
+flash_size = 0x8000 # PIC18F25K22
+
+word_sizes = [1, 4]
+square_funcs = [0, 1]
+uecc_opts = [0, 1, 2, 3]
+xc8_opts = ['0', '1', '2', 's']
+
+def make(target, variables):
+    args = ['make', '-s', '-B', target]
+    args += ['%s=%s' % (k, v) for k, v in variables.items()]
+    return subprocess.run(args, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL).returncode == 0
+
+# last benchmark line, for the biggest image, best host time of a few runs
+def bench(runs=3):
+    best = None
+    for i in range(runs):
+        out = subprocess.run(['./bootloader-bench'], stdout=subprocess.PIPE, universal_newlines=True).stdout
+        cols = out.strip().split('\n')[-1].split()
+        if best is None or int(cols[12]) < int(best['total_us']):
+            best = {'mult': cols[5], 'square': cols[6], 'modinv': cols[4], 'total_us': cols[12]}
+    return best
+
+# bytes programmed from the bootloader offset to the end of flash
+def hex_size(path, btld_offset):
+    size = 0
+    base = 0
+
+    for line in open(path, 'r'):
+        line = line.strip()
+        count = int(line[1:3], 16)
+        addr = int(line[3:7], 16)
+        rec_type = int(line[7:9], 16)
+
+        if rec_type == 4:
+            base = int(line[9:13], 16) << 16
+        elif rec_type == 0:
+            addr += base
+            if addr >= btld_offset and addr < flash_size:
+                size += min(count, flash_size - addr)
+
+    return size
+
+def main():
+    btld_offset = int(sys.argv[1], base=16)
+    with_xc8 = len(sys.argv) > 2 and sys.argv[2] == 'xc8'
+    avail = flash_size - btld_offset
+
+    print("signature check at the biggest benchmark image, host time only compares configurations")
+    if with_xc8:
+        print("xc8 sizes in bytes out of %d available from 0x%x, '!' marks builds that don't fit" % (avail, btld_offset))
+    else:
+        print("xc8 not found, sizes skipped")
+
+    header = "%4s %6s %4s %6s %6s %6s %8s" % ("word", "square", "opt", "mult", "square", "modinv", "host_us")
+    if with_xc8:
+        header += "".join("%8s" % ("-O" + o) for o in xc8_opts)
+    print(header)
+
+    for word_size in word_sizes:
+        for square_func in square_funcs:
+            for uecc_opt in uecc_opts:
+                variables = {'WORD_SIZE': word_size, 'SQUARE_FUNC': square_func, 'UECC_OPT': uecc_opt}
+                line = "%4d %6d %4d " % (word_size, square_func, uecc_opt)
+
+                if make('bootloader-bench', variables):
+                    b = bench()
+                    line += "%6s %6s %6s %8s" % (b['mult'], b['square'], b['modinv'], b['total_us'])
+                else:
+                    line += "%6s %6s %6s %8s" % ("-", "-", "-", "-")
+
+                if with_xc8:
+                    for xc8_opt in xc8_opts:
+                        variables['XC8_OPT'] = xc8_opt
+                        if make('bootloader', variables):
+                            size = hex_size('bootloader.hex', btld_offset)
+                            line += "%8s" % ("%d%s" % (size, "" if size <= avail else "!"))
+                        else:
+                            line += "%8s" % "-"
+
+                print(line)
+                sys.stdout.flush()
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,64 @@
+import sys
+
+# secp256k1 domain parameters
+p = 0xFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFEFFFFFC2F
+gx = 0x79BE667EF9DCBBAC55A06295CE870B07029BFCDB2DCE28D959F2815B16F81798
+gy = 0x483ADA7726A3C4655DA4FBFC0E1108A8FD17B448A68554199C47D08FFB10D4B8
+
+max_window = 7
+
+def point_add(a, b):
+    if a == b:
+        lam = 3 * a[0] * a[0] * pow(2 * a[1], p - 2, p)
+    else:
+        lam = (b[1] - a[1]) * pow(b[0] - a[0], p - 2, p)
+    lam %= p
+    x = (lam * lam - a[0] - b[0]) % p
+    y = (lam * (a[0] - x) - a[1]) % p
+    return (x, y)
+
+# 256 bit number as the curve-specific.inc BYTES_TO_WORDS_8 lines, least significant byte first
+def words(n):
+    b = n.to_bytes(32, 'little')
+    lines = []
+    for i in range(0, 32, 8):
+        lines.append("BYTES_TO_WORDS_8(" + ", ".join("%02X" % x for x in b[i:i + 8]) + ")")
+    return lines
+
+def main():
+    window = max_window
+    if len(sys.argv) > 1:
+        window = int(sys.argv[1])
+
+    if window < 2 or window > max_window:
+        print("window must be between 2 and %d" % max_window, file=sys.stderr)
+        sys.exit(1)
+
+    g = (gx, gy)
+    g2 = point_add(g, g)
+
+    print("/* Generated by tools/gen-g-table.py %d, do not edit. */" % window)
+    print("")
+    print("/* Odd multiples G, 3G, 5G, ... of the secp256k1 generator, in affine")
+    print("   coordinates, for the sliding window in uECC_verify(). Only the entries")
+    print("   reachable with uECC_VERIFY_G_WINDOW bits are compiled in. */")
+    print("static const uECC_word_t secp256k1_G_table[][uECC_MAX_WORDS * 2] = {")
+
+    point = g
+    for i in range(1 << (window - 1)):
+        # entry i is first needed by a window of w bits, with i < 2^(w - 1)
+        if i >= 1 and (i & (i - 1)) == 0:
+            print("#if (uECC_VERIFY_G_WINDOW > %d)" % (i.bit_length()))
+
+        print("    { " + ",\n      ".join(words(point[0])) + ",\n")
+        print("      " + ",\n      ".join(words(point[1])) + " },")
+
+        if i >= 1 and ((i + 1) & i) == 0:
+            print("#endif")
+
+        point = point_add(point, g2)
+
+    print("};")
+
+if __name__ == "__main__":
+    main()